@@ -2,14 +2,62 @@
 #include <string.h>
 #include <algorithm>
 #include "steg_endian.h"
+#include <memory>
+#include <stdexcept>
+#include <openssl/evp.h>
 
 namespace zindorsky {
 namespace crypto {
 
 aes::aes(byte const* key, int keysize) { rekey(key,keysize); }
+
+aes::aes(aes const& other)
+	: ekey_(other.ekey_)
+	, dkey_(other.dkey_)
+	, ctx_(EVP_CIPHER_CTX_new())
+{
+	if (!ctx_ || EVP_CIPHER_CTX_copy(ctx_.get(), other.ctx_.get()) != 1) {
+		throw std::runtime_error("AES encryption failure");
+	}
+}
+
+aes & aes::operator = (aes const& other)
+{
+	if (this != &other) {
+		//copied first, so a failure leaves this one as it was
+		*this = aes(other);
+	}
+	return *this;
+}
+
 void aes::encrypt(byte const* in, byte * out) const { AES_encrypt(in,out,&ekey_); }
 void aes::decrypt(byte const* in, byte * out) const { AES_decrypt(in,out,&dkey_); }
-void aes::rekey(byte const* key, int keysize) { AES_set_encrypt_key(key,keysize*8,&ekey_); AES_set_decrypt_key(key,keysize*8,&dkey_); }
+void aes::rekey(byte const* key, int keysize)
+{
+	AES_set_encrypt_key(key,keysize*8,&ekey_);
+	AES_set_decrypt_key(key,keysize*8,&dkey_);
+	EVP_CIPHER const* cipher = keysize == 32 ? EVP_aes_256_ecb() : keysize == 24 ? EVP_aes_192_ecb() : EVP_aes_128_ecb();
+	if (!ctx_) {
+		ctx_.reset(EVP_CIPHER_CTX_new());
+	}
+	if (!ctx_ || EVP_EncryptInit_ex(ctx_.get(), cipher, nullptr, key, nullptr) != 1 || EVP_CIPHER_CTX_set_padding(ctx_.get(), 0) != 1) {
+		throw std::runtime_error("AES encryption failure");
+	}
+}
+
+void aes::encrypt_blocks(byte const* in, byte * out, size_t count) const
+{
+	if (count == 0) {
+		return;
+	}
+	//An EVP context changes as it's used, so threads can't share one. Copying the keyed context doesn't expand the key again.
+	thread_local std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free);
+	int len = 0;
+	if (!ctx || !ctx_ || EVP_CIPHER_CTX_copy(ctx.get(), ctx_.get()) != 1
+		|| EVP_EncryptUpdate(ctx.get(), out, &len, in, static_cast<int>(count * AES_BLOCK_SIZE)) != 1) {
+		throw std::runtime_error("AES encryption failure");
+	}
+}
 
 namespace {
 
@@ -2,7 +2,9 @@
 
 #include "steg_defs.h"
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <ios>
+#include <memory>
 
 namespace zindorsky {
 namespace crypto {
@@ -10,13 +12,28 @@ namespace crypto {
 class aes {
 public:
 	aes(byte const* key, int keysize);
+	aes(aes const& other);
+	aes & operator = (aes const& other);
+	//Movable; a moved-from aes can only be assigned to or rekeyed.
+	aes(aes && other) noexcept = default;
+	aes & operator = (aes && other) noexcept = default;
+
 	void encrypt(byte const* in, byte * out) const;
 	void decrypt(byte const* in, byte * out) const;
+	//Encrypts "count" blocks independently (ECB) in one go. Goes through EVP, which uses the CPU's AES instructions where there are
+	//any, so it's many times faster per block than encrypt() on long runs. Safe to call from several threads at once.
+	void encrypt_blocks(byte const* in, byte * out, size_t count) const;
 	void rekey(byte const* key, int keysize);
 
 private:
 	AES_KEY ekey_;
 	AES_KEY dkey_;
+	struct cipher_ctx_free {
+		void operator () (EVP_CIPHER_CTX * ctx) const { EVP_CIPHER_CTX_free(ctx); }
+	};
+
+	//Keyed once; encrypt_blocks runs on a per-thread copy of it.
+	std::unique_ptr<EVP_CIPHER_CTX, cipher_ctx_free> ctx_;
 };
 
 class aes_ctr_mode {
@@ -1,16 +1,98 @@
 #include "bmp.h"
 #include "steg_endian.h"
 #include "file_utils.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 
 namespace zindorsky {
 namespace steganography {
 
+namespace {
+	struct bmp_layout {
+		std::uint32_t data_offset, col_count, row_count;
+		std::size_t row_sz, slack_sz;
+	};
+
+	bmp_layout read_layout(provider_t::header_reader const& read)
+	{
+		byte header[54];
+		if (read(0, header, sizeof(header)) < sizeof(header)) {
+			throw invalid_carrier();
+		}
+
+		int bits_per_pixel = (int(header[29])<<8) | header[28];
+		//only 24-bit BMPs for now (others use a palette, which makes steganography more difficult)
+		if( bits_per_pixel != 24 ) {
+			throw std::runtime_error("unsupported BMP format");
+		}
+
+		bmp_layout layout;
+		endian::read_le(&header[10], layout.data_offset);
+		endian::read_le(&header[18], layout.col_count);
+		endian::read_le(&header[22], layout.row_count);
+
+		layout.row_sz = (layout.col_count*bits_per_pixel + 7)/8;
+		if( layout.row_sz % 4 == 0 ) {
+			layout.slack_sz = 0;
+		} else {
+			layout.slack_sz = 4 - layout.row_sz%4;
+		}
+		return layout;
+	}
+
+	//the pixel rows must lie within the file
+	void check_extent(bmp_layout const& layout, std::uint64_t file_sz)
+	{
+		if (layout.data_offset > file_sz || (layout.row_count && (layout.row_sz + layout.slack_sz) > (file_sz - layout.data_offset) / layout.row_count)) {
+			throw invalid_carrier();
+		}
+	}
+
+	//Offset of an index from the start of the pixel rows.
+	std::uint64_t pixel_offset(std::uint64_t row_sz, std::uint64_t slack_sz, provider_t::index_t index)
+	{
+		if( slack_sz == 0 ) {
+			return index;
+		}
+		return (index / row_sz)*(row_sz+slack_sz) + index % row_sz;
+	}
+
+	//One byte of every row, so mapped and paged providers of a file come up with the same salt. "pixel(index)" reads an index.
+	template<class Pixel>
+	byte_vector row_salt(bmp_layout const& layout, Pixel const& pixel)
+	{
+		byte salt[8]={0};
+		for(std::size_t i=0; i<layout.row_count; ++i) {
+			salt[ i%sizeof(salt) ] += pixel(i*layout.row_sz + i%layout.row_sz)>>1;
+		}
+		return byte_vector(salt,salt+sizeof(salt));
+	}
+}
+
 bmp_provider::bmp_provider( filesystem::path const& filename )
-	: bmp_provider( utils::load_from_file(filename) )
+	: bmp_provider( filename, utils::mapped_file::mode::private_copy )
 {
 }
 
+bmp_provider::bmp_provider( filesystem::path const& filename, utils::mapped_file::mode mode )
+	: bmp_provider( utils::mapped_file(filename, mode) )
+{
+}
+
+bmp_provider::bmp_provider( utils::mapped_file && file )
+	: mapping_(std::move(file))
+	, file_(mapping_.data(), mapping_.size())
+{
+	init();
+	//The payload is scattered all over the pixels.
+	mapping_.advise_random();
+	track_changes_ = mapping_.get_mode() == utils::mapped_file::mode::private_copy;
+	if (track_changes_) {
+		changed_ = utils::dirty_blocks(mapping_.size());
+	}
+}
+
 bmp_provider::bmp_provider(byte const* data, size_t size)
 	: bmp_provider( byte_vector(data, data+size) )
 {
@@ -22,34 +104,60 @@ bmp_provider::bmp_provider(byte_vector const& data)
 }
 
 bmp_provider::bmp_provider(byte_vector && data)
-	: file_(std::move(data))
+	: storage_(std::move(data))
+	, file_(storage_.data(), storage_.size())
 {
-	if (file_.size() < 54) {
-		throw invalid_carrier();
-	}
+	init();
+}
 
-	byte const* header = &file_[0];
+bmp_provider::bmp_provider(byte_span data)
+	: file_(data)
+{
+	init();
+}
 
-	int bits_per_pixel = (int(header[29])<<8) | header[28];
-	//only 24-bit BMPs for now (others use a palette, which makes steganography more difficult)
-	if( bits_per_pixel != 24 ) {
-		throw std::runtime_error("unsupported BMP format");
-	}
+bmp_provider::bmp_provider(bmp_provider const& other)
+	: bmp_provider( byte_vector(other.file_.begin(), other.file_.end()) )
+{
+}
 
-	uint32_t data_offset, col_count, row_count;
-	endian::read_le(&header[10], data_offset);
-	endian::read_le(&header[18], col_count);
-	endian::read_le(&header[22], row_count);
-
-	row_sz_ = (col_count*bits_per_pixel + 7)/8;
-	row_count_ = row_count;
-	if( row_sz_ % 4 == 0 ) {
-		slack_sz_ = 0;
-	} else {
-		slack_sz_ = 4 - row_sz_%4;
+bmp_provider & bmp_provider::operator = (bmp_provider const& other)
+{
+	if (this != &other) {
+		*this = bmp_provider(other);
 	}
+	return *this;
+}
+
+void bmp_provider::init()
+{
+	bmp_layout layout = read_layout([this](size_t offset, byte * out, size_t size) -> size_t {
+		if (offset >= file_.size()) {
+			return 0;
+		}
+		size = std::min(size, file_.size() - offset);
+		std::memcpy(out, file_.data() + offset, size);
+		return size;
+	});
+	check_extent(layout, file_.size());
+
+	row_sz_ = layout.row_sz;
+	row_count_ = layout.row_count;
+	slack_sz_ = layout.slack_sz;
+	data_ = file_.data() + layout.data_offset;
+	salt_ = row_salt(layout, [this](index_t index) { return data_[logical_to_physical(index)]; });
+}
 
-	data_ = file_.data() + data_offset;
+provider_t::carrier_info bmp_provider::probe(header_reader const& read)
+{
+	bmp_layout layout = read_layout(read);
+
+	carrier_info info;
+	info.format = format();
+	info.width = layout.col_count;
+	info.height = layout.row_count;
+	info.size = index_t(layout.row_sz) * layout.row_count;
+	return info;
 }
 
 provider_t::index_t bmp_provider::size() const
@@ -59,7 +167,11 @@ provider_t::index_t bmp_provider::size() const
 
 byte & bmp_provider::access_indexed_data( index_t index )
 {
-	return *(data_ + logical_to_physical(index));
+	std::size_t pos = logical_to_physical(index);
+	if (track_changes_) {
+		changed_.mark(static_cast<std::size_t>(data_ - file_.data()) + pos);
+	}
+	return *(data_ + pos);
 }
 
 byte const& bmp_provider::access_indexed_data( index_t index ) const
@@ -67,33 +179,56 @@ byte const& bmp_provider::access_indexed_data( index_t index ) const
 	return *(data_ + logical_to_physical(index));
 }
 
-byte_vector bmp_provider::commit_to_memory()
+void bmp_provider::commit_to_memory(memory_sink & sink)
 {
-	return file_;
+	std::memcpy(sink.reserve(file_.size()), file_.data(), file_.size());
+	sink.commit(file_.size());
 }
 
 void bmp_provider::commit_to_file(filesystem::path const& file)
 {
-	utils::save_to_file(file, file_);
+	std::error_code ec;
+	if (!mapping_.empty() && filesystem::equivalent(file, mapping_.path(), ec)) {
+		if (mapping_.get_mode() == utils::mapped_file::mode::shared) {
+			mapping_.sync();
+			return;
+		}
+		//Only the changed blocks are written, in place; rewriting (let alone truncating) the file isn't needed.
+		mapping_.write_back(changed_.ranges(), options_.durable);
+		changed_.clear();
+		return;
+	}
+	utils::save_to_file(file, file_.data(), file_.size());
 }
 
-byte_vector bmp_provider::salt() const
+std::size_t bmp_provider::logical_to_physical( provider_t::index_t index ) const
 {
-	byte salt[8]={0};
-	for(std::size_t i=0; i<row_count_; ++i) {
-		salt[ i%sizeof(salt) ] += access_indexed_data(i*row_sz_ + i%row_sz_)>>1;
-	}	
+	return static_cast<std::size_t>(pixel_offset(row_sz_, slack_sz_, index));
+}
 
-	return byte_vector(salt,salt+sizeof(salt));
+paged_bmp_provider::paged_bmp_provider( filesystem::path const& filename, std::size_t cache_budget )
+	: paged_provider(filename, cache_budget)
+{
+	bmp_layout layout = read_layout(reader());
+	check_extent(layout, file_size());
+
+	data_offset_ = layout.data_offset;
+	row_sz_ = layout.row_sz;
+	row_count_ = layout.row_count;
+	slack_sz_ = layout.slack_sz;
+	//read through the const overload, which doesn't mark the pages changed
+	provider_t const& self = *this;
+	salt_ = row_salt(layout, [&self](index_t index) { return self.access_indexed_data(index); });
 }
 
-std::size_t bmp_provider::logical_to_physical( provider_t::index_t index ) const
+provider_t::index_t paged_bmp_provider::size() const
 {
-	if( slack_sz_ == 0 ) {
-		return static_cast<std::size_t>(index);
-	}
-	std::size_t row = static_cast<std::size_t>(index / row_sz_), col = static_cast<std::size_t>(index % row_sz_);
-	return row*(row_sz_+slack_sz_) + col;
+	return row_sz_ * row_count_;
+}
+
+std::uint64_t paged_bmp_provider::logical_to_physical( index_t index ) const
+{
+	return data_offset_ + pixel_offset(row_sz_, slack_sz_, index);
 }
 
 }}	//namespace zindorsky::steganography
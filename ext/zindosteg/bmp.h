@@ -1,6 +1,9 @@
 #pragma once
 
 #include "provider.h"
+#include "mapped_file.h"
+#include "paged_provider.h"
+#include <cstdint>
 #include <vector>
 
 namespace zindorsky {
@@ -8,32 +11,69 @@ namespace steganography {
 
 class bmp_provider : public provider_t {
 public:
+	//Maps the file privately, so loading reads nothing and only the pages the payload touches are faulted in.
 	explicit bmp_provider( filesystem::path const& filename );
+	//With mapped_file::mode::shared, writes go straight to the file and committing to it only flushes them.
+	bmp_provider( filesystem::path const& filename, utils::mapped_file::mode mode );
+	explicit bmp_provider( utils::mapped_file && file );
 	bmp_provider(byte const* data, size_t size);
 	explicit bmp_provider(byte_vector const& data);
 	explicit bmp_provider(byte_vector && data);
-	//Copyable
-	bmp_provider(bmp_provider const&) = default;
-	bmp_provider & operator = (bmp_provider const&) = default;
+	//Borrows "data" without copying it; pixels are read and modified in place. The memory must outlive the provider.
+	explicit bmp_provider(byte_span data);
+	//Copyable. A copy always owns its own bytes, even when copied from a borrowing provider.
+	bmp_provider(bmp_provider const& other);
+	bmp_provider & operator = (bmp_provider const& other);
 	//Movable
 	bmp_provider(bmp_provider &&) = default;
 	bmp_provider & operator = (bmp_provider &&) = default;
 
 	static std::string format() { return "BMP"; }
+	static carrier_info probe(header_reader const& read);
 
 	virtual index_t size() const override;
 	virtual byte & access_indexed_data( index_t index ) override;
 	virtual byte const& access_indexed_data( index_t index ) const override;
-	virtual byte_vector commit_to_memory() override;
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override;
 	virtual void commit_to_file(filesystem::path const& file) override;
-	virtual byte_vector salt() const override;
+	virtual byte_vector const& salt() const override { return salt_; }
+	virtual std::size_t memory_footprint() const override { return storage_.size(); }
 
 private:
-	byte_vector file_;
+	//Owned bytes of the file; empty when borrowing or mapped.
+	byte_vector storage_;
+	utils::mapped_file mapping_;
+	//The whole file, in storage_, mapping_ or borrowed memory.
+	byte_span file_;
+	//Blocks written to since the privately mapped file was last committed to its own path; only those are written back.
+	utils::dirty_blocks changed_;
+	bool track_changes_ = false;
 	byte *data_;
 	std::size_t row_sz_, row_count_, slack_sz_; 
+	byte_vector salt_;
 
+	void init();
 	std::size_t logical_to_physical( index_t index ) const;
 };
 
+//A BMP paged in under a bounded memory budget rather than mapped, for files too big to change in memory. Has the same indexed data and
+//salt as bmp_provider.
+class paged_bmp_provider : public paged_provider {
+public:
+	explicit paged_bmp_provider( filesystem::path const& filename, std::size_t cache_budget = paged_provider::memory_budget() );
+
+	static std::string format() { return bmp_provider::format(); }
+
+	virtual index_t size() const override;
+	virtual byte_vector const& salt() const override { return salt_; }
+
+protected:
+	virtual std::uint64_t logical_to_physical( index_t index ) const override;
+
+private:
+	std::uint64_t data_offset_, row_sz_, row_count_, slack_sz_;
+	byte_vector salt_;
+};
+
 }}	//namespace zindorsky::steganography
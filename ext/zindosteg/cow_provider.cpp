@@ -0,0 +1,181 @@
+#include "cow_provider.h"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+
+std::unique_ptr<provider_t> provider_t::with_snapshots(std::unique_ptr<provider_t> provider)
+{
+	return std::make_unique<cow_provider>(std::move(provider));
+}
+
+std::unique_ptr<provider_t> provider_t::clone()
+{
+	throw std::logic_error("provider doesn't support snapshots");
+}
+
+cow_provider::cow_provider(std::shared_ptr<provider_t const> base, reloader reload)
+	: base_(std::move(base))
+	, reload_(std::move(reload))
+{
+}
+
+cow_provider::cow_provider(std::unique_ptr<provider_t> base)
+	: writable_(true)
+{
+	options_ = base->get_commit_options();
+	base_ = std::move(base);
+}
+
+provider_t::index_t cow_provider::size() const
+{
+	return own_ ? own_->size() : base_->size();
+}
+
+byte & cow_provider::access_indexed_data( index_t index )
+{
+	if (own_) {
+		return own_->access_indexed_data(index);
+	}
+	index_t block = index >> block_bits;
+	auto it = blocks_.find(block);
+	if (it == blocks_.end()) {
+		index_t first = block << block_bits, count = std::min<index_t>(block_sz, base_->size() - first);
+		auto copy = std::make_shared<byte_vector>(static_cast<std::size_t>(count));
+		for(index_t i=0; i<count; ++i) {
+			(*copy)[static_cast<std::size_t>(i)] = base_->access_indexed_data(first + i);
+		}
+		it = blocks_.emplace(block, std::move(copy)).first;
+	} else if (it->second.use_count() > 1) {
+		//shared with a clone
+		it->second = std::make_shared<byte_vector>(*it->second);
+	}
+	return (*it->second)[static_cast<std::size_t>(index & (block_sz - 1))];
+}
+
+byte const& cow_provider::access_indexed_data( index_t index ) const
+{
+	if (own_) {
+		return static_cast<provider_t const&>(*own_).access_indexed_data(index);
+	}
+	if (!blocks_.empty()) {
+		auto it = blocks_.find(index >> block_bits);
+		if (it != blocks_.end()) {
+			return (*it->second)[static_cast<std::size_t>(index & (block_sz - 1))];
+		}
+	}
+	return base_->access_indexed_data(index);
+}
+
+void cow_provider::commit_to_memory(memory_sink & sink)
+{
+	commit([&sink](provider_t & p) { p.commit_to_memory(sink); });
+}
+
+void cow_provider::commit_to_file(filesystem::path const& file)
+{
+	commit([&file](provider_t & p) { p.commit_to_file(file); });
+}
+
+byte_vector const& cow_provider::salt() const
+{
+	return own_ ? own_->salt() : base_->salt();
+}
+
+std::size_t cow_provider::memory_footprint() const
+{
+	return own_ ? own_->memory_footprint() : blocks_.size() * block_sz;
+}
+
+std::unique_ptr<provider_t> cow_provider::clone()
+{
+	if (own_) {
+		//Committed by reloading: from now on the reloaded provider is the one to share.
+		base_ = std::move(own_);
+		writable_ = true;
+		reload_ = nullptr;
+	}
+	std::unique_ptr<cow_provider> copy(new cow_provider());
+	copy->options_ = options_;
+	copy->base_ = base_;
+	copy->writable_ = writable_;
+	copy->reload_ = reload_;
+	copy->blocks_ = blocks_;
+	return copy;
+}
+
+template<class F>
+void cow_provider::for_each_change(F const& f) const
+{
+	//in index order, so providers that page their data see the blocks in the order they lie in
+	std::vector<index_t> order;
+	for(auto const& b : blocks_) {
+		order.push_back(b.first);
+	}
+	std::sort(order.begin(), order.end());
+	for(index_t block : order) {
+		byte_vector const& copy = *blocks_.find(block)->second;
+		index_t first = block << block_bits;
+		for(std::size_t i=0; i<copy.size(); ++i) {
+			if (copy[i] != base_->access_indexed_data(first + i)) {
+				f(first + i, copy[i]);
+			}
+		}
+	}
+}
+
+template<class Commit>
+void cow_provider::commit(Commit const& commit)
+{
+	if (own_) {
+		own_->set_commit_options(options_);
+		commit(*own_);
+		return;
+	}
+
+	if (!writable_) {
+		std::unique_ptr<provider_t> own = reload_();
+		for_each_change([&own](index_t index, byte value) { own->access_indexed_data(index) = value; });
+		blocks_.clear();
+		base_.reset();
+		own_ = std::move(own);
+		own_->set_commit_options(options_);
+		commit(*own_);
+		return;
+	}
+
+	provider_t & base = const_cast<provider_t&>(*base_);
+	std::vector<std::pair<index_t, byte>> saved;
+	for_each_change([&](index_t index, byte value) {
+		byte & b = base.access_indexed_data(index);
+		saved.emplace_back(index, b);
+		b = value;
+	});
+	base.set_commit_options(options_);
+	//Nobody else sees the base, so the changes can stay in it.
+	bool exclusive = base_.use_count() == 1;
+	if (exclusive) {
+		blocks_.clear();
+	}
+	auto restore = [&]() {
+		for(auto it = saved.rbegin(); it != saved.rend(); ++it) {
+			base.access_indexed_data(it->first) = it->second;
+		}
+	};
+	try {
+		commit(base);
+	} catch (...) {
+		if (!exclusive) {
+			restore();
+		}
+		throw;
+	}
+	if (!exclusive) {
+		restore();
+	}
+}
+
+}}	//namespace zindorsky::steganography
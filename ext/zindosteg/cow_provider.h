@@ -0,0 +1,54 @@
+#pragma once
+
+#include "provider.h"
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace zindorsky {
+namespace steganography {
+
+//A writable view of a provider that others share. Views only read the shared provider until they are committed; a view copies a block
+//of indexes into its own memory the first time it writes to it, so it costs next to nothing until it's written to, and then only the
+//blocks it touched. Clones of a view share its blocks too, until either of them writes to one.
+class cow_provider : public provider_t {
+public:
+	using reloader = std::function<std::unique_ptr<provider_t>()>;
+
+	//View of a provider that may be read from other threads while the view is used, so it's never written to: committing takes a fresh
+	//provider of the same carrier from "reload", writes the view's changes into it, and from then on the view is just that provider.
+	cow_provider(std::shared_ptr<provider_t const> base, reloader reload);
+	//Takes over "base", which it and its clones share. Committing writes the view's changes into the base for the duration of the commit
+	//(for good, if no other view shares it), so views of one base must not be used on different threads.
+	explicit cow_provider(std::unique_ptr<provider_t> base);
+
+	virtual index_t size() const override;
+	virtual byte & access_indexed_data( index_t index ) override;
+	virtual byte const& access_indexed_data( index_t index ) const override;
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override;
+	virtual void commit_to_file(filesystem::path const& file) override;
+	virtual byte_vector const& salt() const override;
+	//Only the copied blocks; the shared provider is accounted for by whoever shares it.
+	virtual std::size_t memory_footprint() const override;
+	virtual std::unique_ptr<provider_t> clone() override;
+
+private:
+	static const unsigned block_bits = 12;
+	static const std::size_t block_sz = std::size_t(1) << block_bits;
+
+	std::shared_ptr<provider_t const> base_;
+	//Whether views may write to the base (it was handed over rather than shared).
+	bool writable_ = false;
+	reloader reload_;
+	std::unordered_map<index_t, std::shared_ptr<byte_vector>> blocks_;
+	//What a reloading view became when committed.
+	std::unique_ptr<provider_t> own_;
+
+	cow_provider() = default;
+	template<class Commit> void commit(Commit const& commit);
+	//Calls "f(index, value)" for every index whose value differs from the base's, in index order.
+	template<class F> void for_each_change(F const& f) const;
+};
+
+}}	//namespace zindorsky::steganography
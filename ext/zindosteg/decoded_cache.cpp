@@ -0,0 +1,270 @@
+#include "decoded_cache.h"
+#include "steg_endian.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+
+namespace zindorsky {
+namespace steganography {
+namespace decoded_cache {
+
+namespace {
+
+//An entry is this header, then one byte per index of the provider: what access_indexed_data returned right after decoding.
+//  0  magic
+//  8  size of the encoded carrier (LE64)
+// 16  number of indexes (LE64)
+// 24  salt size (LE32)
+// 28  salt
+const char entry_magic[8] = {'Z','S','D','C','A','C','H','1'};
+const std::size_t header_sz = 64, salt_offset = 28, max_salt_sz = header_sz - salt_offset;
+
+std::mutex directory_mutex;
+filesystem::path cache_directory;
+
+//The bytes of an encoded carrier, along with whatever keeps them alive. A mapping's bytes are fetched again when they're used, since it
+//may have been detached meanwhile.
+struct encoded_carrier {
+	std::shared_ptr<utils::shared_mapping> mapping;
+	byte_vector storage;
+	byte_span bytes;
+
+	byte_span get() const { return mapping ? mapping->bytes() : bytes; }
+};
+
+filesystem::path entry_path(filesystem::path const& dir, byte_span carrier)
+{
+	byte digest[EVP_MAX_MD_SIZE];
+	unsigned digest_sz = 0;
+	if (!EVP_Digest(carrier.data(), carrier.size(), digest, &digest_sz, EVP_sha256(), nullptr)) {
+		throw std::runtime_error("SHA-256 failed");
+	}
+	static const char hex[] = "0123456789abcdef";
+	std::string name;
+	for(unsigned i=0; i<digest_sz; ++i) {
+		name += hex[digest[i] >> 4];
+		name += hex[digest[i] & 0xf];
+	}
+	return dir / (name + "-" + std::to_string(carrier.size()) + ".plane");
+}
+
+//Maps the entry if there is a valid one for a carrier of "carrier_sz" bytes.
+bool open_entry(filesystem::path const& path, std::size_t carrier_sz, utils::mapped_file & entry)
+{
+	std::error_code ec;
+	if (!filesystem::exists(path, ec)) {
+		return false;
+	}
+	try {
+		entry = utils::mapped_file(path);
+	} catch (std::exception const&) {
+		return false;
+	}
+
+	if (entry.size() < header_sz || std::memcmp(entry.data(), entry_magic, sizeof(entry_magic)) != 0) {
+		return false;
+	}
+	std::uint64_t encoded_sz, count;
+	std::uint32_t salt_sz;
+	endian::read_le(entry.data() + 8, encoded_sz);
+	endian::read_le(entry.data() + 16, count);
+	endian::read_le(entry.data() + 24, salt_sz);
+	return encoded_sz == carrier_sz && salt_sz <= max_salt_sz && count == entry.size() - header_sz;
+}
+
+void write_entry(filesystem::path const& path, provider_t const& provider, std::size_t carrier_sz)
+{
+	byte_vector const& salt = provider.salt();
+	if (salt.size() > max_salt_sz) {
+		return;
+	}
+	std::size_t count = static_cast<std::size_t>(provider.size());
+	byte_vector entry(header_sz + count, 0);
+	std::memcpy(entry.data(), entry_magic, sizeof(entry_magic));
+	endian::write_le(static_cast<std::uint64_t>(carrier_sz), &entry[8]);
+	endian::write_le(static_cast<std::uint64_t>(count), &entry[16]);
+	endian::write_le(static_cast<std::uint32_t>(salt.size()), &entry[24]);
+	std::copy(salt.begin(), salt.end(), &entry[salt_offset]);
+	for(std::size_t i=0; i<count; ++i) {
+		entry[header_sz + i] = provider.access_indexed_data(i);
+	}
+
+	//Written under a unique name and renamed into place, so other processes never map half an entry.
+	std::error_code ec;
+	filesystem::create_directories(path.parent_path(), ec);
+	filesystem::path temp = path;
+	temp += ".tmp" + std::to_string(std::random_device{}());
+	{
+		std::ofstream f(temp.c_str(), std::ios::binary | std::ios::out);
+		if (!f.write(reinterpret_cast<char const*>(entry.data()), static_cast<std::streamsize>(entry.size()))) {
+			f.close();
+			filesystem::remove(temp, ec);
+			return;
+		}
+	}
+	filesystem::rename(temp, path, ec);
+	if (ec) {
+		filesystem::remove(temp, ec);
+	}
+}
+
+//Serves a carrier from its cache entry until it has to be encoded again.
+class cached_provider : public provider_t {
+public:
+	cached_provider(utils::mapped_file && entry, encoded_carrier && carrier, decoder const& decode)
+		: entry_(std::move(entry))
+		, carrier_(std::move(carrier))
+		, decode_(decode)
+		, plane_(entry_.data() + header_sz)
+	{
+		std::uint64_t count;
+		std::uint32_t salt_sz;
+		endian::read_le(entry_.data() + 16, count);
+		endian::read_le(entry_.data() + 24, salt_sz);
+		size_ = count;
+		changed_ = utils::dirty_blocks(static_cast<std::size_t>(count));
+		salt_.assign(entry_.data() + salt_offset, entry_.data() + salt_offset + salt_sz);
+		//The payload is scattered all over the samples.
+		entry_.advise_random();
+	}
+
+	virtual index_t size() const override
+	{
+		return decoded_ ? decoded_->size() : size_;
+	}
+
+	virtual byte & access_indexed_data(index_t index) override
+	{
+		if (decoded_) {
+			return decoded_->access_indexed_data(index);
+		}
+		changed_.mark(static_cast<std::size_t>(index));
+		return plane_[index];
+	}
+
+	virtual byte const& access_indexed_data(index_t index) const override
+	{
+		if (decoded_) {
+			return static_cast<provider_t const&>(*decoded_).access_indexed_data(index);
+		}
+		return plane_[index];
+	}
+
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override { decoded().commit_to_memory(sink); }
+	virtual void commit_to_file(filesystem::path const& file) override { decoded().commit_to_file(file); }
+	virtual byte_vector const& salt() const override { return salt_; }
+	virtual bool concurrent_reads() const override { return decoded_ ? decoded_->concurrent_reads() : true; }
+	//The plane is mapped from the entry, but the encoded carrier kept for decoding may be held in memory.
+	virtual std::size_t memory_footprint() const override
+	{
+		return decoded_ ? decoded_->memory_footprint()
+			: changed_.memory_footprint() + carrier_.storage.size() + (carrier_.mapping ? carrier_.mapping->memory_footprint() : 0);
+	}
+
+private:
+	utils::mapped_file entry_;
+	encoded_carrier carrier_;
+	decoder decode_;
+	byte * plane_;
+	index_t size_;
+	byte_vector salt_;
+	//Blocks of indexes written to before the carrier was decoded.
+	utils::dirty_blocks changed_;
+	std::unique_ptr<provider_t> decoded_;
+
+	//Encoding needs the codec's own state, so the carrier is decoded after all, the first time it's committed.
+	provider_t & decoded()
+	{
+		if (!decoded_) {
+			byte_span bytes = carrier_.get();
+			decoded_ = decode_(bytes.data(), bytes.size(), carrier_.mapping);
+			//In index order, which is also the order the samples lie in. Only samples that differ are written, so that the decoded
+			//carrier doesn't take the rest of a block for changed too.
+			provider_t const& fresh = *decoded_;
+			for(auto const& range : changed_.ranges()) {
+				for(index_t i = range.first; i < range.first + range.second; ++i) {
+					if (fresh.access_indexed_data(i) != plane_[i]) {
+						decoded_->access_indexed_data(i) = plane_[i];
+					}
+				}
+			}
+			changed_ = utils::dirty_blocks();
+			entry_ = utils::mapped_file();
+			carrier_ = encoded_carrier();
+			plane_ = nullptr;
+		}
+		decoded_->set_commit_options(options_);
+		return *decoded_;
+	}
+};
+
+std::unique_ptr<provider_t> load_carrier(encoded_carrier && carrier, bool borrowed, decoder const& decode)
+{
+	filesystem::path dir = directory();
+	if (dir.empty()) {
+		return decode(carrier.bytes.data(), carrier.bytes.size(), carrier.mapping);
+	}
+
+	filesystem::path path = entry_path(dir, carrier.bytes);
+	utils::mapped_file entry;
+	if (open_entry(path, carrier.bytes.size(), entry)) {
+		if (borrowed) {
+			carrier.storage.assign(carrier.bytes.begin(), carrier.bytes.end());
+			carrier.bytes = byte_span(carrier.storage.data(), carrier.storage.size());
+		}
+		return std::make_unique<cached_provider>(std::move(entry), std::move(carrier), decode);
+	}
+
+	auto provider = decode(carrier.bytes.data(), carrier.bytes.size(), carrier.mapping);
+	try {
+		write_entry(path, *provider, carrier.bytes.size());
+	} catch (std::exception const&) {
+		//Not being able to cache never stops a carrier from loading.
+	}
+	return provider;
+}
+
+}	//namespace
+
+void set_directory(filesystem::path const& dir)
+{
+	std::lock_guard<std::mutex> lock(directory_mutex);
+	cache_directory = dir;
+}
+
+filesystem::path directory()
+{
+	std::lock_guard<std::mutex> lock(directory_mutex);
+	return cache_directory;
+}
+
+std::unique_ptr<provider_t> load(std::shared_ptr<utils::shared_mapping> const& carrier, decoder const& decode)
+{
+	encoded_carrier c;
+	c.bytes = carrier->bytes();
+	c.mapping = carrier;
+	return load_carrier(std::move(c), false, decode);
+}
+
+std::unique_ptr<provider_t> load(byte_vector && carrier, decoder const& decode)
+{
+	encoded_carrier c;
+	c.storage = std::move(carrier);
+	c.bytes = byte_span(c.storage.data(), c.storage.size());
+	return load_carrier(std::move(c), false, decode);
+}
+
+std::unique_ptr<provider_t> load(byte const* data, std::size_t size, decoder const& decode)
+{
+	encoded_carrier c;
+	c.bytes = byte_span(const_cast<byte*>(data), size);
+	return load_carrier(std::move(c), true, decode);
+}
+
+}}}	//namespace zindorsky::steganography::decoded_cache
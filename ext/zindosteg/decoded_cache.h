@@ -0,0 +1,28 @@
+#pragma once
+
+#include "provider.h"
+#include "mapped_file.h"
+#include <functional>
+#include <memory>
+
+namespace zindorsky {
+namespace steganography {
+namespace decoded_cache {
+
+//Opt-in directory where the decoded samples of JPEG and PNG carriers are kept between loads, so that loading the same carrier again maps
+//them instead of decoding it. Entries are keyed by the SHA-256 and size of the encoded carrier, so it doesn't matter where it's loaded
+//from. An empty path (the default) turns the cache off. Entries are never removed; deleting the directory's files at any time is safe.
+void set_directory(filesystem::path const& dir);
+filesystem::path directory();
+
+//Decodes a carrier into its provider. "file" is the mapping "data" lie in, if they do, which the provider may keep instead of a copy.
+using decoder = std::function<std::unique_ptr<provider_t>(byte const* data, std::size_t size, std::shared_ptr<utils::shared_mapping> const& file)>;
+
+//Loads through the cache. On a hit the provider serves samples and salt from the cache entry, and only decodes the carrier (with "decode")
+//if it is committed, then applies the samples changed so far. On a miss the carrier is decoded and an entry is written for next time.
+//The overloads taking a mapping or a vector hand it to a cache hit provider, which keeps it for that decode; otherwise the data is copied.
+std::unique_ptr<provider_t> load(std::shared_ptr<utils::shared_mapping> const& carrier, decoder const& decode);
+std::unique_ptr<provider_t> load(byte_vector && carrier, decoder const& decode);
+std::unique_ptr<provider_t> load(byte const* data, std::size_t size, decoder const& decode);
+
+}}}	//namespace zindorsky::steganography::decoded_cache
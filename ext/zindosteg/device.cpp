@@ -1,12 +1,28 @@
 #include "device.h"
+#include <algorithm>
 #include <cassert>
+#include <vector>
 #include "steg_endian.h"
+#include "parallel.h"
 
 namespace zindorsky {
 namespace steganography {
 
 enum { max_length_sz = 9, nybble_span = 15, byte_span = nybble_span*2, };
 
+namespace {
+	//Bytes located at a time by bulk reads and writes, and the fewest worth permuting as a batch.
+	const std::streamsize bulk_run = 0x8000, min_batch_run = 16;
+	//Indexes permuted at once, and the fewest worth starting threads for.
+	const std::size_t batch_sz = 0x400, min_parallel_count = 0x10000;
+}
+
+std::streamsize device_t::capacity_for(provider_t::index_t carrier_size)
+{
+	std::streamsize sz = static_cast<std::streamsize>(carrier_size / byte_span) - max_length_sz;
+	return sz > 0 ? sz : 0;
+}
+
 device_t::device_t( filesystem::path const& carrier_file, std::string const& password, bool open_existing_payload, bool throw_on_open_existing_fail )
 	: device_t( provider_t::load(carrier_file), password, open_existing_payload, throw_on_open_existing_fail )
 {
@@ -16,7 +32,7 @@ device_t::device_t( filesystem::path const& carrier_file, std::string const& pas
 device_t::device_t( std::unique_ptr<provider_t> provider, std::string const& password, bool open_existing_payload, bool throw_on_open_existing_fail )
 	: provider_( std::move(provider) )
 	, shuffler_(provider_->size() / nybble_span, crypto::key_generator(password,provider_->salt()))
-	, max_sz_( provider_->size() / byte_span - max_length_sz )
+	, max_sz_( static_cast<std::streamsize>(provider_->size() / byte_span) - max_length_sz )
 	, payload_sz_( 0 )
 	, pos_(0)
 	, dirty_(false)
@@ -48,15 +64,18 @@ std::streamsize device_t::read(char * s, std::streamsize n)
 	if( pos_ >= payload_sz_ ) {
 		return std::char_traits<char_type>::eof();
 	}
-	std::streamsize r=0;
-	while(n > 0 && pos_ < payload_sz_) {
-		*s = static_cast<char>(get_byte(pos_));
-		++s;
-		pos_ += 1;
-		++r;
-		--n;
+	n = std::min<std::streamsize>(n, payload_sz_ - pos_);
+	std::vector<provider_t::index_t> starts(static_cast<std::size_t>(std::min(n, bulk_run)) * 2);
+	for(std::streamsize done = 0; done < n; ) {
+		std::streamsize run = std::min(n - done, bulk_run);
+		locate(pos_, run, starts.data());
+		for(std::streamsize i=0; i<run; ++i) {
+			*s++ = static_cast<char>(get_byte(starts[i*2], starts[i*2+1]));
+		}
+		pos_ += run;
+		done += run;
 	}
-	return r;
+	return n;
 }
 
 std::streamsize device_t::write(char const* s, std::streamsize n)
@@ -67,20 +86,22 @@ std::streamsize device_t::write(char const* s, std::streamsize n)
 	if( pos_ >= max_sz_ ) {
 		return std::char_traits<char_type>::eof();
 	}
-	std::streamsize r=0;
-	while(n > 0 && pos_ < max_sz_) {
-		byte b = static_cast<byte>(*s);
-		put_byte(b,pos_);
-		++s;
-		pos_ += 1;
-		++r;
-		--n;
+	n = std::min<std::streamsize>(n, max_sz_ - pos_);
+	std::vector<provider_t::index_t> starts(static_cast<std::size_t>(std::min(n, bulk_run)) * 2);
+	for(std::streamsize done = 0; done < n; ) {
+		std::streamsize run = std::min(n - done, bulk_run);
+		locate(pos_, run, starts.data());
+		for(std::streamsize i=0; i<run; ++i) {
+			put_byte(static_cast<byte>(*s++), starts[i*2], starts[i*2+1]);
+		}
+		pos_ += run;
+		done += run;
 	}
 	if( pos_ > payload_sz_ ) {
 		payload_sz_ = pos_;
 		dirty_ = true;
 	}
-	return r;
+	return n;
 }
 
 std::streampos device_t::seek(std::streamoff off, std::ios::seekdir way)
@@ -127,46 +148,79 @@ void device_t::write_to_file(filesystem::path const& outfile)
 }
 
 byte_vector device_t::write_to_memory()
+{
+	vector_sink sink;
+	write_to_memory(sink);
+	return sink.release();
+}
+
+void device_t::write_to_memory(memory_sink & sink)
 {
 	if (dirty_) {
 		write_payload_length();
 	}
-	dirty_ = false;
-	return provider_->commit_to_memory();
+	provider_->commit_to_memory(sink);
+	//the carrier file itself hasn't been updated yet
+	if (carrier_file_.empty()) {
+		dirty_ = false;
+	}
 }
 
-byte device_t::get_byte(std::streampos const& pos, provider_t::index_t * lo_start, provider_t::index_t * hi_start) const
+void device_t::locate(std::streampos const& pos, std::streamsize n, provider_t::index_t * starts) const
 {
-	assert( pos < max_sz_ + max_length_sz );
+	assert( pos + n <= max_sz_ + max_length_sz );
 
-	provider_t::index_t index = shuffler_[pos*2]*nybble_span;
-	if(lo_start) { *lo_start = index; }
+	std::size_t count = static_cast<std::size_t>(n)*2;
+	for(std::size_t i=0; i<count; ++i) {
+		starts[i] = static_cast<provider_t::index_t>(pos)*2 + i;
+	}
+	if (n < min_batch_run) {
+		for(std::size_t i=0; i<count; ++i) {
+			starts[i] = shuffler_[starts[i]];
+		}
+	} else {
+		std::size_t batches = (count + batch_sz - 1) / batch_sz;
+		auto map_batch = [&](std::size_t b) {
+			std::size_t first = b * batch_sz;
+			shuffler_.map(starts + first, starts + first, std::min(batch_sz, count - first));
+		};
+		if (count < min_parallel_count) {
+			for(std::size_t b=0; b<batches; ++b) {
+				map_batch(b);
+			}
+		} else {
+			utils::parallel_for(batches, map_batch);
+		}
+	}
+	for(std::size_t i=0; i<count; ++i) {
+		starts[i] *= nybble_span;
+	}
+}
+
+byte device_t::get_byte(provider_t::index_t lo_start, provider_t::index_t hi_start) const
+{
+	//Read through the const interface so that providers don't treat reads as modifications.
+	provider_t const& provider = *provider_;
 
 	byte cl=0;
 	for(byte i=1; i<=nybble_span; ++i) {
-		if( provider_->access_indexed_data( index++ ) & 1 ) {
+		if( provider.access_indexed_data( lo_start++ ) & 1 ) {
 			cl ^= i;
 		}
 	}
 
-	index = shuffler_[pos*2+1]*nybble_span;
-	if(hi_start) { *hi_start = index; }
-
 	byte ch=0;
 	for(byte i=1; i<=nybble_span; ++i) {
-		if( provider_->access_indexed_data( index++ ) & 1 ) {
+		if( provider.access_indexed_data( hi_start++ ) & 1 ) {
 			ch ^= i;
 		}
 	}
 	return (ch<<4)|cl;
 }
 
-void device_t::put_byte(byte b, std::streampos const& pos)
+void device_t::put_byte(byte b, provider_t::index_t lo_start, provider_t::index_t hi_start)
 {
-	assert( pos < max_sz_ + max_length_sz );
-
-	provider_t::index_t lo_start, hi_start;
-	byte c = get_byte(pos,&lo_start,&hi_start);
+	byte c = get_byte(lo_start,hi_start);
 	byte cl = c&15, ch = c>>4, bl = b&15, bh = b>>4;
 	if(bl != cl) {
 		provider_->access_indexed_data( lo_start + (bl^cl) - 1 ) ^= 1;
@@ -178,6 +232,20 @@ void device_t::put_byte(byte b, std::streampos const& pos)
 	}
 }
 
+byte device_t::get_byte(std::streampos const& pos) const
+{
+	provider_t::index_t starts[2];
+	locate(pos, 1, starts);
+	return get_byte(starts[0], starts[1]);
+}
+
+void device_t::put_byte(byte b, std::streampos const& pos)
+{
+	provider_t::index_t starts[2];
+	locate(pos, 1, starts);
+	put_byte(b, starts[0], starts[1]);
+}
+
 std::streamsize device_t::truncate()
 {
     if(payload_sz_ != pos_) {
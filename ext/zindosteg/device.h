@@ -41,11 +41,19 @@ public:
 	//Not part of the I/O streams interface, but sometimes handy:
 	std::streamsize size() const { return payload_sz_; }
 	std::streamsize capacity() const { return max_sz_; }
+	//Payload capacity of a carrier whose provider reports "carrier_size" (e.g. from provider_t::probe); 0 if it can't hold a payload.
+	static std::streamsize capacity_for(provider_t::index_t carrier_size);
 	std::streamsize truncate(); //sets eof to current position
 	void flush();
 
 	void write_to_file(filesystem::path const& outfile);
 	byte_vector write_to_memory();
+	//Writes the carrier into "sink". A device opened from a file still saves to that file on flush or close.
+	void write_to_memory(memory_sink & sink);
+
+	//Applies to subsequent flushes and writes of the carrier.
+	void set_commit_options(provider_t::commit_options const& options) { provider_->set_commit_options(options); }
+	provider_t::commit_options const& get_commit_options() const { return provider_->get_commit_options(); }
 
 	//Returns salt derived from the carrier.
 	byte_vector salt_for_encryption() const;
@@ -58,7 +66,12 @@ private:
 	std::streampos pos_;
 	bool dirty_;
 
-	byte get_byte(std::streampos const& pos, provider_t::index_t * lo_start = 0, provider_t::index_t * hi_start = 0) const;
+	//Fills "starts" with the first index of the low and then the high nybble of each of the "n" bytes from "pos". The permutation is
+	//the costly part of getting at a byte, and needs no provider, so long runs are permuted in batches, on several threads.
+	void locate(std::streampos const& pos, std::streamsize n, provider_t::index_t * starts) const;
+	byte get_byte(provider_t::index_t lo_start, provider_t::index_t hi_start) const;
+	void put_byte(byte b, provider_t::index_t lo_start, provider_t::index_t hi_start);
+	byte get_byte(std::streampos const& pos) const;
 	void put_byte(byte b, std::streampos const& pos);
 
 	std::streamsize read_payload_length(bool throw_on_fail = true) const;
@@ -1,10 +1,10 @@
 require "mkmf-rice"
 
-sources = %w{aes key_generator permutator bmp jpeg_helpers jpeg png_provider loader device}
+sources = %w{aes key_generator permutator bmp jpeg_entropy jpeg_memory jpeg_helpers jpeg png_deflate png_provider wav y4m page_cache paged_provider mapped_file decoded_cache cow_provider provider_cache loader device}
 $srcs = sources.map { |file| "#{file}.cpp" }
 $objs = sources.map { |file| "#{file}.o" } << "zindosteg.o"
-$CPPFLAGS << " -std=c++17 -O2"
-$LDFLAGS << " -lcrypto -ljpeg -lpng"
+$CPPFLAGS << " -std=c++17 -O2 -pthread"
+$LDFLAGS << " -lcrypto -ljpeg -lpng -lz -pthread"
 $LDFLAGS << " -lstdc++fs" if have_macro("EXPERIMENTAL_FILESYSTEM", "steg_defs.h")
 
 create_makefile("zindosteg/zindosteg")
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <limits>
 #include "steg_defs.h"
 #include <vector>
+#if !defined(_WIN32)
+# include <sys/types.h>
+#endif
 
 namespace zindorsky {
 namespace steganography {
@@ -26,10 +32,25 @@ inline byte_vector load_from_file( filesystem::path const& filename )
 	return buffer;
 }
 
-inline void save_to_file( filesystem::path const& filename, byte_vector const& data )
+inline void save_to_file( filesystem::path const& filename, byte const* data, size_t size )
 {
 	std::ofstream f(filename.c_str(), std::ios::binary | std::ios::out);
-	f.write(reinterpret_cast<char const*>(data.data()), data.size());
+	f.write(reinterpret_cast<char const*>(data), size);
+}
+
+inline void save_to_file( filesystem::path const& filename, byte_vector const& data )
+{
+	save_to_file(filename, data.data(), data.size());
+}
+
+//fseek to "offset" from the start, which may be past what a long holds (as on Windows, where long is 32 bits).
+inline bool seek_file( std::FILE * f, std::uint64_t offset )
+{
+#if defined(_WIN32)
+	return offset <= static_cast<std::uint64_t>(std::numeric_limits<__int64>::max()) && ::_fseeki64(f, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+	return offset <= static_cast<std::uint64_t>(std::numeric_limits<off_t>::max()) && ::fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
 }
 
 }}}	//namespace zinodrsky::steganography::utils
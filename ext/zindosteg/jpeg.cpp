@@ -1,14 +1,19 @@
 #include "jpeg.h"
 #include "steg_endian.h"
 #include "file_utils.h"
+#include <algorithm>
 #include <stdexcept>
 
 namespace zindorsky {
 namespace steganography {
 
 jpeg_provider::jpeg_provider( filesystem::path const& filename )
-	: jpeg_provider( utils::load_from_file(filename) )
+	: jinfo_(filename)
+	, component_count_(0)
+	, sz_(0)
+	, paged_(false)
 {
+	init();
 }
 
 jpeg_provider::jpeg_provider(byte_vector const& data)
@@ -17,14 +22,33 @@ jpeg_provider::jpeg_provider(byte_vector const& data)
 }
 
 jpeg_provider::jpeg_provider(byte const* data, size_t size)
-	: jpeg_provider( byte_vector(data, data+size) )
+	: jinfo_(data, size)
+	, component_count_(0)
+	, sz_(0)
+	, paged_(false)
 {
+	init();
 }
 
 jpeg_provider::jpeg_provider(byte_vector && data)
 	: jinfo_(std::move(data))
 	, component_count_(0)
 	, sz_(0)
+	, paged_(false)
+{
+	init();
+}
+
+jpeg_provider::jpeg_provider(std::shared_ptr<utils::shared_mapping> const& file)
+	: jinfo_(file)
+	, component_count_(0)
+	, sz_(0)
+	, paged_(false)
+{
+	init();
+}
+
+void jpeg_provider::init()
 {
 	component_count_ = static_cast<std::size_t>( jinfo_.object()->num_components );
 	wib_.resize(component_count_);
@@ -36,6 +60,95 @@ jpeg_provider::jpeg_provider(byte_vector && data)
 		comp_sz_[i] = wib_[i]*hib_[i]*DCTSIZE2;
 		sz_ += comp_sz_[i];
 	}
+	paged_ = jinfo_.memory_usage().spilled != 0;
+
+	//One coefficient from each block row. The sums don't depend on visiting order, so start from the rows the decoder wrote last,
+	//which are still in cache (or in memory, when paged).
+	byte salt[8] = {0};
+	std::size_t salt_index = 0;
+	for(std::size_t i=0; i<component_count_; ++i) {
+		salt_index += hib_[i];
+	}
+	for(std::size_t i=component_count_; i-- > 0;) {
+		for(std::size_t j=hib_[i]; j-- > 0;) {
+			JBLOCKARRAY rowblock = jpeg::access_virt_barray_throwing( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[i], (JDIMENSION)j, 1, FALSE);
+			salt[ --salt_index % sizeof(salt) ] += static_cast<byte>( rowblock[0][j%wib_[i]][j%DCTSIZE2]>>1 );
+		}
+	}
+	salt_.assign(salt, salt+sizeof(salt));
+}
+
+provider_t::carrier_info jpeg_provider::probe(header_reader const& read)
+{
+	byte marker[4];
+	if (read(0, marker, 2) < 2 || marker[0] != 0xff || marker[1] != 0xd8) {
+		throw invalid_carrier();
+	}
+
+	//Walk the marker segments up to the frame header.
+	std::size_t offset = 2;
+	for (;;) {
+		if (read(offset, marker, 2) < 2 || marker[0] != 0xff) {
+			throw invalid_carrier();
+		}
+		if (marker[1] == 0xff) {	//fill byte
+			++offset;
+			continue;
+		}
+		if (marker[1] == 0x01 || (marker[1] >= 0xd0 && marker[1] <= 0xd7)) {	//no length field
+			offset += 2;
+			continue;
+		}
+		if (marker[1] == 0xd9 || marker[1] == 0xda || read(offset + 2, marker + 2, 2) < 2) {
+			throw invalid_carrier();
+		}
+		std::size_t length = (std::size_t(marker[2]) << 8) | marker[3];
+		if (length < 2) {
+			throw invalid_carrier();
+		}
+		if (marker[1] >= 0xc0 && marker[1] <= 0xcf && marker[1] != 0xc4 && marker[1] != 0xc8 && marker[1] != 0xcc) {
+			break;
+		}
+		offset += 2 + length;
+	}
+
+	//SOFn: precision, height, width, component count, then id, sampling factors and quantization table of each component.
+	byte frame[6 + 3*MAX_COMPONENTS];
+	std::size_t length = (std::size_t(marker[2]) << 8) | marker[3];
+	if (length < 8 || read(offset + 4, frame, 6) < 6) {
+		throw invalid_carrier();
+	}
+	std::uint32_t height = (std::uint32_t(frame[1]) << 8) | frame[2];
+	std::uint32_t width = (std::uint32_t(frame[3]) << 8) | frame[4];
+	int components = frame[5];
+	if (height == 0 || width == 0 || components == 0 || components > MAX_COMPONENTS || length < 8 + 3u*components
+		|| read(offset + 10, frame + 6, 3*components) < 3u*components)
+	{
+		throw invalid_carrier();
+	}
+
+	int max_h = 1, max_v = 1;
+	for (int i = 0; i < components; ++i) {
+		int h = frame[6 + 3*i + 1] >> 4, v = frame[6 + 3*i + 1] & 0xf;
+		if (h < 1 || h > MAX_SAMP_FACTOR || v < 1 || v > MAX_SAMP_FACTOR) {
+			throw invalid_carrier();
+		}
+		max_h = std::max(max_h, h);
+		max_v = std::max(max_v, v);
+	}
+
+	carrier_info info;
+	info.format = format();
+	info.width = width;
+	info.height = height;
+	//Same block counts libjpeg computes for the coefficient arrays.
+	for (int i = 0; i < components; ++i) {
+		int h = frame[6 + 3*i + 1] >> 4, v = frame[6 + 3*i + 1] & 0xf;
+		index_t wib = (index_t(width)*h + max_h*DCTSIZE - 1) / (max_h*DCTSIZE);
+		index_t hib = (index_t(height)*v + max_v*DCTSIZE - 1) / (max_v*DCTSIZE);
+		info.size += wib * hib * DCTSIZE2;
+	}
+	return info;
 }
 
 provider_t::index_t jpeg_provider::size() const
@@ -43,51 +156,87 @@ provider_t::index_t jpeg_provider::size() const
 	return sz_;
 }
 
+std::size_t jpeg_provider::memory_footprint() const
+{
+	return jinfo_.memory_usage().in_memory + jinfo_.original_in_memory() + pending_.size() * (sizeof(index_t) + sizeof(byte));
+}
+
 #if LITTLE_ENDIAN
 # define INT16_LSB 0
 #else
 # define INT16_LSB 1
 #endif
 
+namespace {
+	//Most pending writes held before they are applied to paged coefficients.
+	const std::size_t max_pending = 1 << 16;
+}
+
 byte & jpeg_provider::access_indexed_data( provider_t::index_t index )
 {
+	if (paged_) {
+		auto it = pending_.find(index);
+		if (it != pending_.end()) {
+			return it->second;
+		}
+		if (pending_.size() >= max_pending) {
+			apply_pending();
+		}
+		byte current = static_cast<jpeg_provider const&>(*this).access_indexed_data(index);
+		return pending_.emplace(index, current).first->second;
+	}
+
 	std::size_t comp, row, col, block;
 	index_to_coordinates(index,comp,row,col,block);
-	JBLOCKARRAY rowblock = (*jinfo_.object()->mem->access_virt_barray)( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[comp], (JDIMENSION)row, 1, TRUE);
+	jinfo_.touch(comp, row, col);
+	JBLOCKARRAY rowblock = jpeg::access_virt_barray_throwing( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[comp], (JDIMENSION)row, 1, TRUE);
 	return reinterpret_cast<byte*>( &rowblock[0][col][block] )[ INT16_LSB ];
 }
 
 byte const& jpeg_provider::access_indexed_data( provider_t::index_t index ) const
 {
+	if (!pending_.empty()) {
+		auto it = pending_.find(index);
+		if (it != pending_.end()) {
+			return it->second;
+		}
+	}
+
 	std::size_t comp, row, col, block;
 	index_to_coordinates(index,comp,row,col,block);
-	JBLOCKARRAY rowblock = (*jinfo_.object()->mem->access_virt_barray)( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[comp], (JDIMENSION)row, 1, FALSE);
+	JBLOCKARRAY rowblock = jpeg::access_virt_barray_throwing( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[comp], (JDIMENSION)row, 1, FALSE);
 	return reinterpret_cast<byte const*>( &rowblock[0][col][block] )[ INT16_LSB ];
 }
 
-byte_vector jpeg_provider::commit_to_memory()
+void jpeg_provider::apply_pending() const
 {
-	return jinfo_.save_to_memory();
+	if (pending_.empty()) {
+		return;
+	}
+	//Indexes run component by component, row by row, which is also the order the bands are laid out in.
+	std::vector<std::pair<index_t, byte>> writes(pending_.begin(), pending_.end());
+	pending_.clear();
+	std::sort(writes.begin(), writes.end());
+	auto & jinfo = const_cast<jpeg::decompress_ctx&>(jinfo_);
+	for(auto const& w : writes) {
+		std::size_t comp, row, col, block;
+		index_to_coordinates(w.first,comp,row,col,block);
+		jinfo.touch(comp, row, col);
+		JBLOCKARRAY rowblock = jpeg::access_virt_barray_throwing( (j_common_ptr)jinfo.object(), jinfo.coefficients()[comp], (JDIMENSION)row, 1, TRUE);
+		reinterpret_cast<byte*>( &rowblock[0][col][block] )[ INT16_LSB ] = w.second;
+	}
 }
 
-void jpeg_provider::commit_to_file(filesystem::path const& file)
+void jpeg_provider::commit_to_memory(memory_sink & sink)
 {
-	jinfo_.save_to_file(file);
+	apply_pending();
+	jinfo_.save_to_memory(sink, options_.parallel);
 }
 
-byte_vector jpeg_provider::salt() const
+void jpeg_provider::commit_to_file(filesystem::path const& file)
 {
-	byte salt[8] = {0};
-	std::size_t salt_index=0;
-
-	for(std::size_t i=0; i<component_count_; ++i) {
-		for(std::size_t j=0; j<hib_[i]; ++j) {
-			JBLOCKARRAY rowblock = (*jinfo_.object()->mem->access_virt_barray)( (j_common_ptr)jinfo_.object(), jinfo_.coefficients()[i], (JDIMENSION)j, 1, FALSE);
-			salt[ salt_index++ % sizeof(salt) ] += static_cast<byte>( rowblock[0][j%wib_[i]][j%DCTSIZE2]>>1 );
-		}
-	}
-
-	return byte_vector(salt, salt+sizeof(salt));
+	apply_pending();
+	jinfo_.save_to_file(file, options_.parallel);
 }
 
 void jpeg_provider::index_to_coordinates(provider_t::index_t index, std::size_t & comp, std::size_t & row, std::size_t & col, std::size_t & block) const
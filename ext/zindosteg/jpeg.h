@@ -2,6 +2,7 @@
 
 #include "provider.h"
 #include <exception>
+#include <unordered_map>
 #include "jpeg_helpers.h"
 
 namespace zindorsky {
@@ -13,18 +14,28 @@ public:
     explicit jpeg_provider(byte_vector const& data);
     explicit jpeg_provider(byte_vector && data);
     jpeg_provider(byte const* data, size_t size);
+	//Carriers with restart intervals keep the mapping to splice from, instead of a copy.
+	explicit jpeg_provider(std::shared_ptr<utils::shared_mapping> const& file);
 	//Movable:
 	jpeg_provider(jpeg_provider &&) = default;
 	jpeg_provider & operator = (jpeg_provider &&) = default;
 	
 	static std::string format() { return "JPG"; }
+	static carrier_info probe(header_reader const& read);
 
 	virtual index_t size() const override;
 	virtual byte & access_indexed_data( index_t index ) override;
 	virtual byte const& access_indexed_data( index_t index ) const override;
-	virtual byte_vector commit_to_memory() override;
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override;
 	virtual void commit_to_file(filesystem::path const& file) override;
-	virtual byte_vector salt() const override;
+	virtual byte_vector const& salt() const override { return salt_; }
+	virtual std::size_t memory_footprint() const override;
+	//Reading paged coefficients pages bands in and out.
+	virtual bool concurrent_reads() const override { return !paged_; }
+
+	//Coefficient memory use; see jpeg::set_memory_budget.
+	jpeg::memory_usage memory_usage() const { return jinfo_.memory_usage(); }
 
 private:
 	jpeg::decompress_ctx jinfo_;
@@ -32,7 +43,15 @@ private:
 	std::size_t component_count_;
 	std::vector<std::size_t> wib_, hib_, comp_sz_;
 	index_t sz_;
+	byte_vector salt_;
+
+	//When the coefficients are paged to disk, writes are held here and applied in row order, so that scattered writes
+	//don't each page a band in and out.
+	bool paged_;
+	mutable std::unordered_map<index_t, byte> pending_;
 
+	void init();
+	void apply_pending() const;
 	void index_to_coordinates(index_t index, std::size_t & comp, std::size_t & row, std::size_t & col, std::size_t & block) const;
 };
 
@@ -0,0 +1,960 @@
+#include "jpeg_entropy.h"
+#include "jpeg_memory.h"
+#include "parallel.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace zindorsky {
+namespace steganography {
+namespace jpeg {
+
+namespace {
+
+//Zig-zag order to natural (row major) order.
+const int natural_order[DCTSIZE2] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+std::size_t div_round_up(std::size_t a, std::size_t b)
+{
+	return (a + b - 1) / b;
+}
+
+//Reads bits MSB first from entropy-coded data, removing stuffed zero bytes.
+//Past the end of the data it supplies zero bits, as libjpeg does.
+class bit_reader {
+public:
+	bit_reader(byte const* begin, byte const* end) : p_(begin), end_(end) {}
+
+	//Guarantees at least 57 bits are buffered.
+	void fill()
+	{
+		while(bits_ <= 56) {
+			std::uint64_t b = 0;
+			if (p_ < end_) {
+				b = *p_++;
+				if (b == 0xff && p_ < end_ && *p_ == 0) {
+					++p_;
+				}
+			}
+			acc_ |= b << (56 - bits_);
+			bits_ += 8;
+		}
+	}
+
+	unsigned peek(int n) const { return static_cast<unsigned>(acc_ >> (64 - n)); }
+	void skip(int n) { acc_ <<= n; bits_ -= n; }
+	unsigned get(int n) { unsigned v = peek(n); skip(n); return v; }
+
+private:
+	byte const* p_, *end_;
+	std::uint64_t acc_ = 0;
+	int bits_ = 0;
+};
+
+//Decoding tables for one Huffman table, built as described in JPEG spec section F.2.2.3, plus a lookahead table for short codes.
+class huffman_decoder {
+public:
+	enum { lookahead = 9 };
+
+	//Returns false if the table is malformed.
+	bool build(JHUFF_TBL const* tbl)
+	{
+		if (!tbl) {
+			return false;
+		}
+		std::uint32_t codes[256];
+		byte sizes[256];
+		int count = 0;
+		std::int32_t code = 0;
+		for(int len=1; len<=16; ++len) {
+			valoffset_[len] = count - code;
+			for(int i=0; i<tbl->bits[len]; ++i) {
+				if (count >= 256) {
+					return false;
+				}
+				sizes[count] = static_cast<byte>(len);
+				codes[count++] = static_cast<std::uint32_t>(code++);
+			}
+			if (code > (1 << len)) {
+				return false;
+			}
+			maxcode_[len] = tbl->bits[len] ? code - 1 : -1;
+			code <<= 1;
+		}
+		for(int i=0; i<count; ++i) {
+			values_[i] = tbl->huffval[i];
+		}
+		for(auto & entry : lookup_) {
+			entry = 0;
+		}
+		for(int i=0; i<count; ++i) {
+			if (sizes[i] <= lookahead) {
+				int spare = lookahead - sizes[i];
+				std::uint32_t first = codes[i] << spare;
+				for(std::uint32_t j=0; j < (1u << spare); ++j) {
+					lookup_[first + j] = static_cast<std::uint16_t>((sizes[i] << 8) | values_[i]);
+				}
+			}
+		}
+		return true;
+	}
+
+	//Returns the decoded symbol, or -1 for a code not in the table.
+	int decode(bit_reader & br) const
+	{
+		std::uint16_t entry = lookup_[br.peek(lookahead)];
+		if (entry >> 8) {
+			br.skip(entry >> 8);
+			return entry & 0xff;
+		}
+		for(int len=lookahead+1; len<=16; ++len) {
+			std::int32_t code = static_cast<std::int32_t>(br.peek(len));
+			if (code <= maxcode_[len]) {
+				br.skip(len);
+				return values_[code + valoffset_[len]];
+			}
+		}
+		return -1;
+	}
+
+private:
+	std::uint16_t lookup_[1 << lookahead];
+	std::int32_t maxcode_[17], valoffset_[17];
+	byte values_[256];
+};
+
+int extend(unsigned v, int s)
+{
+	return v < (1u << (s-1)) ? static_cast<int>(v) - (1 << s) + 1 : static_cast<int>(v);
+}
+
+//One block of an MCU: which component of the scan it belongs to, and its position relative to the MCU's top-left block of that component.
+struct mcu_block {
+	int comp;
+	std::size_t row, col, v_samp, h_samp;
+};
+
+//The blocks making up every MCU of a scan over "count" components. A single component scan has one block per MCU.
+std::vector<mcu_block> mcu_blocks(jpeg_component_info * const* comps, int count)
+{
+	std::vector<mcu_block> blocks;
+	if (count == 1) {
+		blocks.push_back({0, 0, 0, 1, 1});
+		return blocks;
+	}
+	for(int i=0; i<count; ++i) {
+		std::size_t v_samp = static_cast<std::size_t>(comps[i]->v_samp_factor), h_samp = static_cast<std::size_t>(comps[i]->h_samp_factor);
+		for(std::size_t v=0; v<v_samp; ++v) {
+			for(std::size_t h=0; h<h_samp; ++h) {
+				blocks.push_back({i, v, h, v_samp, h_samp});
+			}
+		}
+	}
+	return blocks;
+}
+
+//Decodes one block into "block". Returns false on corrupt data.
+bool decode_block(bit_reader & br, huffman_decoder const& dc, huffman_decoder const& ac, int & dc_pred, JCOEF * block)
+{
+	br.fill();
+	int s = dc.decode(br);
+	if (s < 0 || s > 15) {
+		return false;
+	}
+	if (s) {
+		dc_pred += extend(br.get(s), s);
+	}
+	block[0] = static_cast<JCOEF>(dc_pred);
+
+	for(int k=1; k<DCTSIZE2; ) {
+		br.fill();
+		int rs = ac.decode(br);
+		if (rs < 0) {
+			return false;
+		}
+		int r = rs >> 4;
+		s = rs & 15;
+		if (s) {
+			k += r;
+			if (k >= DCTSIZE2) {
+				return false;
+			}
+			block[natural_order[k++]] = static_cast<JCOEF>(extend(br.get(s), s));
+		} else if (r == 15) {
+			k += 16;
+		} else {
+			break;
+		}
+	}
+	return true;
+}
+
+
+//Writes entropy-coded bits MSB first, stuffing a zero after every 0xFF byte.
+class bit_writer {
+public:
+	explicit bit_writer(byte_vector & out) : out_(out), pos_(out.size()) {}
+	~bit_writer() { out_.resize(pos_); }
+
+	//Makes room for at least "n" more output bytes. put() doesn't check for space itself.
+	void reserve(std::size_t n)
+	{
+		if (out_.size() - pos_ < n) {
+			out_.resize(std::max(out_.size() * 2, pos_ + n));
+		}
+	}
+
+	//"size" must be at most 16.
+	void put(std::uint32_t code, int size)
+	{
+		acc_ = (acc_ << size) | (code & ((1u << size) - 1));
+		bits_ += size;
+		if (bits_ < 32) {
+			return;
+		}
+		std::uint32_t word = static_cast<std::uint32_t>(acc_ >> (bits_ - 32));
+		bits_ -= 32;
+		byte * p = out_.data() + pos_;
+		//Fast path when none of the four bytes needs stuffing.
+		if ((word & 0x80808080u & ~(word + 0x01010101u)) == 0) {
+			p[0] = static_cast<byte>(word >> 24);
+			p[1] = static_cast<byte>(word >> 16);
+			p[2] = static_cast<byte>(word >> 8);
+			p[3] = static_cast<byte>(word);
+			pos_ += 4;
+			return;
+		}
+		for(int shift=24; shift>=0; shift-=8) {
+			put_byte(static_cast<byte>(word >> shift));
+		}
+	}
+
+	//Writes out any whole bytes and pads the final partial byte with one bits.
+	void flush()
+	{
+		if (bits_ % 8) {
+			int pad = 8 - bits_ % 8;
+			acc_ = (acc_ << pad) | ((1u << pad) - 1);
+			bits_ += pad;
+		}
+		while(bits_ > 0) {
+			bits_ -= 8;
+			put_byte(static_cast<byte>(acc_ >> bits_));
+		}
+	}
+
+	//Appends raw bytes (e.g. a marker). Only valid right after flush().
+	void raw(byte b1, byte b2)
+	{
+		out_[pos_++] = b1;
+		out_[pos_++] = b2;
+	}
+
+private:
+	byte_vector & out_;
+	std::size_t pos_;
+	std::uint64_t acc_ = 0;
+	int bits_ = 0;
+
+	void put_byte(byte b)
+	{
+		out_[pos_++] = b;
+		if (b == 0xff) {
+			out_[pos_++] = 0;
+		}
+	}
+};
+
+//Code words for one Huffman table (JPEG spec section C).
+struct huffman_encoder {
+	std::uint16_t code[256];
+	//Zero for symbols the table can't represent.
+	byte size[256];
+
+	void build(JHUFF_TBL const& tbl)
+	{
+		for(auto & s : size) {
+			s = 0;
+		}
+		int p = 0;
+		std::uint32_t c = 0;
+		for(int len=1; len<=16; ++len) {
+			for(int i=0; i<tbl.bits[len]; ++i, ++p) {
+				code[tbl.huffval[p]] = static_cast<std::uint16_t>(c++);
+				size[tbl.huffval[p]] = static_cast<byte>(len);
+			}
+			c <<= 1;
+		}
+	}
+};
+
+//Huffman table classes
+enum { dc_class = 0, ac_class = 1 };
+
+//Marker codes not defined by jpeglib.h
+enum { m_sof0 = 0xc0, m_sof1 = 0xc1, m_dht = 0xc4, m_soi = 0xd8, m_sos = 0xda, m_dqt = 0xdb, m_dri = 0xdd };
+
+//Output policy for encode_block that gathers symbol statistics for optimizing the tables.
+struct symbol_counter {
+	std::int64_t freq[2][NUM_HUFF_TBLS][257] = {};
+
+	void reserve(std::size_t) {}
+	void symbol(int cls, int tbl, int sym) { ++freq[cls][tbl][sym]; }
+	void bits(std::uint32_t, int) {}
+};
+
+//Output policy for encode_block that writes the coded bits.
+struct symbol_writer {
+	bit_writer out;
+	huffman_encoder const (*tables)[NUM_HUFF_TBLS];
+	//Set if a symbol had no code in its table.
+	bool missing = false;
+
+	symbol_writer(byte_vector & data, huffman_encoder const (*tables)[NUM_HUFF_TBLS]) : out(data), tables(tables) {}
+
+	void reserve(std::size_t n) { out.reserve(n); }
+	void symbol(int cls, int tbl, int sym)
+	{
+		huffman_encoder const& enc = tables[cls][tbl];
+		if (!enc.size[sym]) {
+			missing = true;
+		}
+		out.put(enc.code[sym], enc.size[sym]);
+	}
+	void bits(std::uint32_t value, int n) { out.put(value, n); }
+};
+
+//Worst case output for one block, byte stuffing included.
+const std::size_t max_block_bytes = 2 * (16 + 11 + (DCTSIZE2-1) * (16 + 10)) / 8 + 2;
+
+//Number of bits needed to represent "v".
+inline int bit_length(unsigned v)
+{
+#if defined(__GNUC__)
+	return v ? 32 - __builtin_clz(v) : 0;
+#else
+	int n = 0;
+	for(; v; v >>= 1) {
+		++n;
+	}
+	return n;
+#endif
+}
+
+//Index of the lowest set bit of a non-zero "v".
+inline int lowest_bit(std::uint64_t v)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	for(; !(v & 1); v >>= 1) {
+		++n;
+	}
+	return n;
+#endif
+}
+
+//Codes one block the way libjpeg's encode_one_block does. Returns false for coefficients too large for 8-bit baseline.
+template<class Out>
+bool encode_block(Out & out, int dc_tbl, int ac_tbl, int & last_dc, JCOEF const* block)
+{
+	int diff = block[0] - last_dc;
+	last_dc = block[0];
+	int nbits = bit_length(static_cast<unsigned>(diff < 0 ? -diff : diff));
+	if (nbits > 11) {
+		return false;
+	}
+	out.symbol(dc_class, dc_tbl, nbits);
+	if (nbits) {
+		out.bits(static_cast<std::uint32_t>(diff < 0 ? diff - 1 : diff), nbits);
+	}
+
+	//Gather the AC coefficients in zig-zag order along with a bitmap of the non-zero ones, then walk the bitmap.
+	JCOEF zz[DCTSIZE2];
+	std::uint64_t nonzero = 0;
+	for(int k=1; k<DCTSIZE2; ++k) {
+		zz[k] = block[natural_order[k]];
+		nonzero |= static_cast<std::uint64_t>(zz[k] != 0) << k;
+	}
+	int prev = 0;
+	while(nonzero) {
+		int k = lowest_bit(nonzero);
+		nonzero &= nonzero - 1;
+		int run = k - prev - 1;
+		for(; run > 15; run -= 16) {
+			out.symbol(ac_class, ac_tbl, 0xf0);
+		}
+		int v = zz[k];
+		nbits = bit_length(static_cast<unsigned>(v < 0 ? -v : v));
+		if (nbits > 10) {
+			return false;
+		}
+		out.symbol(ac_class, ac_tbl, (run << 4) + nbits);
+		out.bits(static_cast<std::uint32_t>(v < 0 ? v - 1 : v), nbits);
+		prev = k;
+	}
+	if (prev != DCTSIZE2 - 1) {
+		out.symbol(ac_class, ac_tbl, 0);
+	}
+	return true;
+}
+
+//Row pointers of the components of a scan, indexed like mcu_block::comp.
+//They are gathered up front so that worker threads never call into the memory manager.
+using scan_rows = std::vector<std::vector<JBLOCKROW>>;
+
+scan_rows gather_rows(jpeg_decompress_struct * info, jvirt_barray_ptr* coeff, jpeg_component_info * const* comps, int count)
+{
+	scan_rows rows(count);
+	for(int i=0; i<count; ++i) {
+		jpeg_component_info const& comp = *comps[i];
+		std::size_t total = div_round_up(comp.height_in_blocks, comp.v_samp_factor) * comp.v_samp_factor;
+		rows[i].resize(total);
+		for(std::size_t r=0; r<total; ++r) {
+			rows[i][r] = access_virt_barray_throwing( (j_common_ptr)info, coeff[comp.component_index], static_cast<JDIMENSION>(r), 1, FALSE )[0];
+		}
+	}
+	return rows;
+}
+
+//Codes MCUs [first,last) as one restart interval, i.e. with the DC predictions starting from zero.
+template<class Out>
+bool code_mcus(Out & out, std::vector<mcu_block> const& blocks, scan_rows const& rows, int const* dc_tbl, int const* ac_tbl, std::size_t mcus_per_row, std::size_t first, std::size_t last)
+{
+	int last_dc[MAX_COMPS_IN_SCAN] = {0};
+	for(std::size_t mcu=first; mcu<last; ++mcu) {
+		std::size_t mcu_row = mcu / mcus_per_row, mcu_col = mcu % mcus_per_row;
+		out.reserve(blocks.size() * max_block_bytes);
+		for(auto const& b : blocks) {
+			JCOEF const* block = rows[b.comp][mcu_row * b.v_samp + b.row][mcu_col * b.h_samp + b.col];
+			if (!encode_block(out, dc_tbl[b.comp], ac_tbl[b.comp], last_dc[b.comp], block)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//Limited-length optimal Huffman code for the given symbol counts, per JPEG spec section K.2 (as in libjpeg's jpeg_gen_optimal_table).
+//"freq" is clobbered. False if the counts are so skewed that a code would be longer than 32 bits (libjpeg's JERR_HUFF_CLEN_OVERFLOW).
+bool gen_optimal_table(std::int64_t freq[257], JHUFF_TBL & tbl)
+{
+	const int max_clen = 32;
+	int bits[max_clen+1] = {0}, codesize[257] = {0}, others[257];
+	for(auto & o : others) {
+		o = -1;
+	}
+	//Reserve one code point so that no real symbol gets the all-ones code word.
+	freq[256] = 1;
+
+	for(;;) {
+		int c1 = -1, c2 = -1;
+		std::int64_t v = INT64_MAX;
+		for(int i=0; i<=256; ++i) {
+			if (freq[i] && freq[i] <= v) {
+				v = freq[i];
+				c1 = i;
+			}
+		}
+		v = INT64_MAX;
+		for(int i=0; i<=256; ++i) {
+			if (freq[i] && freq[i] <= v && i != c1) {
+				v = freq[i];
+				c2 = i;
+			}
+		}
+		if (c2 < 0) {
+			break;
+		}
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		for(++codesize[c1]; others[c1] >= 0; ++codesize[c1]) {
+			c1 = others[c1];
+		}
+		others[c1] = c2;
+		for(++codesize[c2]; others[c2] >= 0; ++codesize[c2]) {
+			c2 = others[c2];
+		}
+	}
+
+	for(int i=0; i<=256; ++i) {
+		if (codesize[i] > max_clen) {
+			return false;
+		}
+		if (codesize[i]) {
+			++bits[codesize[i]];
+		}
+	}
+	//Move codes longer than 16 bits up the tree.
+	int i = max_clen;
+	for(; i > 16; --i) {
+		while(bits[i] > 0) {
+			int j = i - 2;
+			while(bits[j] == 0) {
+				--j;
+			}
+			bits[i] -= 2;
+			bits[i-1]++;
+			bits[j+1] += 2;
+			bits[j]--;
+		}
+	}
+	//Drop the reserved code point, which has the longest code.
+	while(bits[i] == 0) {
+		--i;
+	}
+	bits[i]--;
+
+	tbl.bits[0] = 0;
+	for(i=1; i<=16; ++i) {
+		tbl.bits[i] = static_cast<UINT8>(bits[i]);
+	}
+	int p = 0;
+	for(i=1; i<=max_clen; ++i) {
+		for(int j=0; j<256; ++j) {
+			if (codesize[j] == i) {
+				tbl.huffval[p++] = static_cast<UINT8>(j);
+			}
+		}
+	}
+	tbl.sent_table = FALSE;
+	return true;
+}
+
+void put_u16(byte_vector & out, unsigned v)
+{
+	out.push_back(static_cast<byte>(v >> 8));
+	out.push_back(static_cast<byte>(v));
+}
+
+//Writes a marker segment header: the marker and a length covering "sz" bytes of data.
+void put_marker(byte_vector & out, int marker, std::size_t sz)
+{
+	out.push_back(0xff);
+	out.push_back(static_cast<byte>(marker));
+	put_u16(out, static_cast<unsigned>(sz + 2));
+}
+
+//Everything ahead of the entropy-coded data, in the order libjpeg's transcoder writes it.
+void write_headers(jpeg_decompress_struct const* info, JHUFF_TBL const (*tables)[NUM_HUFF_TBLS], int const* tbl_no, unsigned restart_interval, byte_vector & out)
+{
+	int comps = info->num_components;
+	out.push_back(0xff);
+	out.push_back(m_soi);
+
+	//jpeg_set_colorspace decides between JFIF and Adobe markers this way:
+	J_COLOR_SPACE cs = info->jpeg_color_space;
+	if (cs == JCS_GRAYSCALE || cs == JCS_YCbCr) {
+		bool copy = info->saw_JFIF_marker != FALSE;
+		put_marker(out, JPEG_APP0, 14);
+		for(char c : {'J','F','I','F','\0'}) {
+			out.push_back(static_cast<byte>(c));
+		}
+		bool version = copy && info->JFIF_major_version == 1;
+		out.push_back(version ? info->JFIF_major_version : 1);
+		out.push_back(version ? info->JFIF_minor_version : 1);
+		out.push_back(copy ? info->density_unit : 0);
+		put_u16(out, copy ? info->X_density : 1);
+		put_u16(out, copy ? info->Y_density : 1);
+		out.push_back(0);
+		out.push_back(0);
+	} else if (cs == JCS_RGB || cs == JCS_CMYK || cs == JCS_YCCK) {
+		put_marker(out, JPEG_APP0+14, 12);
+		for(char c : {'A','d','o','b','e'}) {
+			out.push_back(static_cast<byte>(c));
+		}
+		put_u16(out, 100);
+		put_u16(out, 0);
+		put_u16(out, 0);
+		out.push_back(cs == JCS_YCCK ? 2 : 0);
+	}
+
+	for(jpeg_saved_marker_ptr curr=info->marker_list; curr; curr=curr->next) {
+		if (curr->data && curr->data_length > 0) {
+			put_marker(out, curr->marker, curr->data_length);
+			out.insert(out.end(), curr->data, curr->data + curr->data_length);
+		}
+	}
+
+	bool baseline = true, sent[NUM_QUANT_TBLS] = {false};
+	for(int ci=0; ci<comps; ++ci) {
+		int q = info->comp_info[ci].quant_tbl_no;
+		if (sent[q]) {
+			continue;
+		}
+		sent[q] = true;
+		JQUANT_TBL const* qtbl = info->comp_info[ci].quant_table ? info->comp_info[ci].quant_table : info->quant_tbl_ptrs[q];
+		bool wide = false;
+		for(auto v : qtbl->quantval) {
+			wide = wide || v > 255;
+		}
+		baseline = baseline && !wide;
+		put_marker(out, m_dqt, 1 + DCTSIZE2 * (wide ? 2 : 1));
+		out.push_back(static_cast<byte>((wide ? 0x10 : 0) | q));
+		for(int k=0; k<DCTSIZE2; ++k) {
+			if (wide) {
+				put_u16(out, qtbl->quantval[natural_order[k]]);
+			} else {
+				out.push_back(static_cast<byte>(qtbl->quantval[natural_order[k]]));
+			}
+		}
+	}
+
+	put_marker(out, baseline ? m_sof0 : m_sof1, 6 + 3*comps);
+	out.push_back(8);
+	put_u16(out, info->image_height);
+	put_u16(out, info->image_width);
+	out.push_back(static_cast<byte>(comps));
+	for(int ci=0; ci<comps; ++ci) {
+		jpeg_component_info const& comp = info->comp_info[ci];
+		out.push_back(static_cast<byte>(comp.component_id));
+		out.push_back(static_cast<byte>((comp.h_samp_factor << 4) | comp.v_samp_factor));
+		out.push_back(static_cast<byte>(comp.quant_tbl_no));
+	}
+
+	for(int cls=0; cls<2; ++cls) {
+		bool written[NUM_HUFF_TBLS] = {false};
+		for(int ci=0; ci<comps; ++ci) {
+			int t = tbl_no[ci];
+			if (written[t]) {
+				continue;
+			}
+			written[t] = true;
+			JHUFF_TBL const& tbl = tables[cls][t];
+			int count = 0;
+			for(int len=1; len<=16; ++len) {
+				count += tbl.bits[len];
+			}
+			put_marker(out, m_dht, 17 + count);
+			out.push_back(static_cast<byte>((cls << 4) | t));
+			out.insert(out.end(), tbl.bits + 1, tbl.bits + 17);
+			out.insert(out.end(), tbl.huffval, tbl.huffval + count);
+		}
+	}
+
+	put_marker(out, m_dri, 2);
+	put_u16(out, restart_interval);
+
+	put_marker(out, m_sos, 4 + 2*comps);
+	out.push_back(static_cast<byte>(comps));
+	for(int ci=0; ci<comps; ++ci) {
+		out.push_back(static_cast<byte>(info->comp_info[ci].component_id));
+		out.push_back(static_cast<byte>((tbl_no[ci] << 4) | tbl_no[ci]));
+	}
+	out.push_back(0);
+	out.push_back(DCTSIZE2 - 1);
+	out.push_back(0);
+}
+
+} //namespace
+
+bool find_restart_intervals(jpeg_decompress_struct * info, byte const* data, std::size_t size, scan_layout & layout)
+{
+	if (info->progressive_mode || info->arith_code || info->data_precision != 8 || info->restart_interval == 0
+		|| info->comps_in_scan != info->num_components || !info->src)
+	{
+		return false;
+	}
+	for(int i=0; i<info->comps_in_scan; ++i) {
+		jpeg_component_info const* comp = info->cur_comp_info[i];
+		if (!info->dc_huff_tbl_ptrs[comp->dc_tbl_no] || !info->ac_huff_tbl_ptrs[comp->ac_tbl_no]) {
+			return false;
+		}
+	}
+
+	byte const* scan = info->src->next_input_byte;
+	if (scan < data || scan > data + size) {
+		return false;
+	}
+
+	if (info->comps_in_scan == 1) {
+		layout.mcus_per_row = info->cur_comp_info[0]->width_in_blocks;
+		layout.mcu_rows = info->cur_comp_info[0]->height_in_blocks;
+	} else {
+		layout.mcus_per_row = div_round_up(info->image_width, static_cast<std::size_t>(info->max_h_samp_factor) * DCTSIZE);
+		layout.mcu_rows = div_round_up(info->image_height, static_cast<std::size_t>(info->max_v_samp_factor) * DCTSIZE);
+	}
+	layout.restart_interval = info->restart_interval;
+	std::size_t expected = div_round_up(layout.mcus_per_row * layout.mcu_rows, layout.restart_interval);
+
+	layout.segments.clear();
+	layout.segments.reserve(expected);
+	std::size_t start = static_cast<std::size_t>(scan - data), i = start;
+	byte marker = 0;
+	for(;;) {
+		while(i < size && data[i] != 0xff) {
+			++i;
+		}
+		if (i >= size) {
+			//Ran off the end without an EOI.
+			return false;
+		}
+		std::size_t j = i + 1;
+		while(j < size && data[j] == 0xff) {
+			++j;
+		}
+		if (j >= size) {
+			return false;
+		}
+		if (data[j] == 0) {
+			//stuffed zero
+			i = j + 1;
+			continue;
+		}
+		layout.segments.push_back({start, i - start});
+		marker = data[j];
+		if (marker < JPEG_RST0 || marker > JPEG_RST0 + 7) {
+			layout.end = i;
+			break;
+		}
+		if (marker != JPEG_RST0 + (layout.segments.size() - 1) % 8 || layout.segments.size() >= expected) {
+			return false;
+		}
+		start = i = j + 1;
+	}
+
+	//Anything other than EOI after the scan (e.g. DNL or another scan) is left to libjpeg.
+	return layout.segments.size() == expected && marker == JPEG_EOI;
+}
+
+jvirt_barray_ptr* decode_restart_intervals(jpeg_decompress_struct * info, byte const* data, scan_layout const& layout)
+{
+	int comps = info->num_components;
+	huffman_decoder dc[MAX_COMPS_IN_SCAN], ac[MAX_COMPS_IN_SCAN];
+	for(int i=0; i<info->comps_in_scan; ++i) {
+		jpeg_component_info const* comp = info->cur_comp_info[i];
+		if (!dc[i].build(info->dc_huff_tbl_ptrs[comp->dc_tbl_no]) || !ac[i].build(info->ac_huff_tbl_ptrs[comp->ac_tbl_no])) {
+			return nullptr;
+		}
+	}
+
+	//Same array shapes as jpeg_read_coefficients, but with every row accessible at once so that threads can write straight into them.
+	jvirt_barray_ptr* coeff = static_cast<jvirt_barray_ptr*>( alloc_small_throwing((j_common_ptr)info, JPOOL_IMAGE, sizeof(jvirt_barray_ptr)*comps) );
+	std::vector<JDIMENSION> rows(comps);
+	for(int ci=0; ci<comps; ++ci) {
+		jpeg_component_info const& comp = info->comp_info[ci];
+		rows[ci] = static_cast<JDIMENSION>( div_round_up(comp.height_in_blocks, comp.v_samp_factor) * comp.v_samp_factor );
+		coeff[ci] = request_virt_barray_throwing( (j_common_ptr)info, JPOOL_IMAGE, TRUE,
+			static_cast<JDIMENSION>( div_round_up(comp.width_in_blocks, comp.h_samp_factor) * comp.h_samp_factor ),
+			rows[ci], rows[ci] );
+	}
+	realize_virt_arrays_throwing((j_common_ptr)info);
+
+	std::vector<JBLOCKARRAY> planes(info->comps_in_scan);
+	for(int i=0; i<info->comps_in_scan; ++i) {
+		jpeg_component_info const* comp = info->cur_comp_info[i];
+		planes[i] = access_virt_barray_throwing( (j_common_ptr)info, coeff[comp->component_index], 0, rows[comp->component_index], TRUE );
+		if (!planes[i]) {
+			return nullptr;
+		}
+	}
+	std::vector<mcu_block> blocks = mcu_blocks(info->cur_comp_info, info->comps_in_scan);
+
+	std::size_t total_mcus = layout.mcus_per_row * layout.mcu_rows;
+	std::atomic<bool> corrupt{false};
+	utils::parallel_for(layout.segments.size(), [&](std::size_t s) {
+		segment const& seg = layout.segments[s];
+		bit_reader br(data + seg.offset, data + seg.offset + seg.length);
+		int dc_pred[MAX_COMPS_IN_SCAN] = {0};
+		std::size_t mcu = s * layout.restart_interval, last = std::min(total_mcus, mcu + layout.restart_interval);
+		for(; mcu < last; ++mcu) {
+			std::size_t mcu_row = mcu / layout.mcus_per_row, mcu_col = mcu % layout.mcus_per_row;
+			for(auto const& b : blocks) {
+				std::size_t row = mcu_row * b.v_samp + b.row, col = mcu_col * b.h_samp + b.col;
+				if (!decode_block(br, dc[b.comp], ac[b.comp], dc_pred[b.comp], planes[b.comp][row][col])) {
+					corrupt.store(true, std::memory_order_relaxed);
+					return;
+				}
+			}
+		}
+	});
+
+	return corrupt.load() ? nullptr : coeff;
+}
+
+byte_vector encode_restart_intervals(jpeg_decompress_struct * info, jvirt_barray_ptr* coeff)
+{
+	int comps = info->num_components;
+	if (!coeff || comps < 1 || comps > MAX_COMPS_IN_SCAN || info->data_precision != 8) {
+		return {};
+	}
+	int blocks_in_mcu = 0;
+	jpeg_component_info * comp_ptrs[MAX_COMPS_IN_SCAN];
+	for(int ci=0; ci<comps; ++ci) {
+		jpeg_component_info & comp = info->comp_info[ci];
+		comp_ptrs[ci] = &comp;
+		blocks_in_mcu += comp.h_samp_factor * comp.v_samp_factor;
+		if (comp.quant_tbl_no < 0 || comp.quant_tbl_no >= NUM_QUANT_TBLS || (!comp.quant_table && !info->quant_tbl_ptrs[comp.quant_tbl_no])) {
+			return {};
+		}
+	}
+	if (comps > 1 && blocks_in_mcu > C_MAX_BLOCKS_IN_MCU) {
+		return {};
+	}
+
+	std::size_t mcus_per_row, mcu_rows;
+	if (comps == 1) {
+		mcus_per_row = info->comp_info[0].width_in_blocks;
+		mcu_rows = info->comp_info[0].height_in_blocks;
+	} else {
+		mcus_per_row = div_round_up(info->image_width, static_cast<std::size_t>(info->max_h_samp_factor) * DCTSIZE);
+		mcu_rows = div_round_up(info->image_height, static_cast<std::size_t>(info->max_v_samp_factor) * DCTSIZE);
+	}
+	if (mcus_per_row == 0 || mcus_per_row > 0xffff || mcu_rows == 0) {
+		return {};
+	}
+	std::vector<mcu_block> blocks = mcu_blocks(comp_ptrs, comps);
+
+	scan_rows rows = gather_rows(info, coeff, comp_ptrs, comps);
+
+	//Luminance gets table 0 and chrominance table 1, as with libjpeg's defaults.
+	int tbl_no[MAX_COMPS_IN_SCAN];
+	for(int ci=0; ci<comps; ++ci) {
+		tbl_no[ci] = ci == 0 ? 0 : 1;
+	}
+
+	//Each worker takes a contiguous run of MCU rows; every MCU row is one restart interval.
+	std::size_t chunks = std::min(utils::worker_count(), mcu_rows);
+	auto code_rows = [&](std::size_t chunk, auto & out, auto && before_row, auto && after_row) {
+		for(std::size_t r = mcu_rows*chunk/chunks, end = mcu_rows*(chunk+1)/chunks; r < end; ++r) {
+			before_row(r);
+			if (!code_mcus(out, blocks, rows, tbl_no, tbl_no, mcus_per_row, r * mcus_per_row, (r+1) * mcus_per_row)) {
+				return false;
+			}
+			after_row(r);
+		}
+		return true;
+	};
+	auto no_op = [](std::size_t) {};
+
+	//Pass 1: symbol statistics.
+	std::vector<symbol_counter> counts(chunks);
+	std::vector<char> ok(chunks, 0);
+	utils::parallel_for(chunks, [&](std::size_t w) {
+		ok[w] = code_rows(w, counts[w], no_op, no_op);
+	});
+	for(auto o : ok) {
+		if (!o) {
+			return {};
+		}
+	}
+
+	JHUFF_TBL tables[2][NUM_HUFF_TBLS];
+	huffman_encoder encoders[2][NUM_HUFF_TBLS];
+	for(int cls=0; cls<2; ++cls) {
+		for(int t=0; t<(comps > 1 ? 2 : 1); ++t) {
+			std::int64_t freq[257] = {0};
+			for(auto const& c : counts) {
+				for(int i=0; i<256; ++i) {
+					freq[i] += c.freq[cls][t][i];
+				}
+			}
+			if (!gen_optimal_table(freq, tables[cls][t])) {
+				return {};
+			}
+			encoders[cls][t].build(tables[cls][t]);
+		}
+	}
+
+	//Pass 2: entropy code each worker's rows into its own buffer, restart markers included, then stitch them together.
+	std::vector<byte_vector> parts(chunks);
+	utils::parallel_for(chunks, [&](std::size_t w) {
+		symbol_writer out(parts[w], encoders);
+		auto before_row = [&](std::size_t r) {
+			if (r > 0) {
+				out.reserve(2);
+				out.out.raw(0xff, static_cast<byte>(JPEG_RST0 + (r-1) % 8));
+			}
+		};
+		auto after_row = [&](std::size_t) {
+			out.reserve(16);
+			out.out.flush();
+		};
+		code_rows(w, out, before_row, after_row);
+	});
+
+	byte_vector result;
+	write_headers(info, tables, tbl_no, static_cast<unsigned>(mcus_per_row), result);
+	std::size_t total = result.size() + 2;
+	for(auto const& p : parts) {
+		total += p.size();
+	}
+	result.reserve(total);
+	for(auto & p : parts) {
+		result.insert(result.end(), p.begin(), p.end());
+		byte_vector().swap(p);
+	}
+	result.push_back(0xff);
+	result.push_back(JPEG_EOI);
+	return result;
+}
+
+byte_vector splice_restart_intervals(jpeg_decompress_struct * info, jvirt_barray_ptr* coeff, byte const* data, std::size_t size, scan_layout const& layout, std::vector<bool> const& dirty)
+{
+	std::vector<std::size_t> todo;
+	for(std::size_t i=0; i<layout.segments.size(); ++i) {
+		if (dirty[i]) {
+			todo.push_back(i);
+		}
+	}
+
+	std::vector<byte_vector> coded(todo.size());
+	if (!todo.empty()) {
+		int dc_tbl[MAX_COMPS_IN_SCAN], ac_tbl[MAX_COMPS_IN_SCAN];
+		huffman_encoder encoders[2][NUM_HUFF_TBLS];
+		for(int i=0; i<info->comps_in_scan; ++i) {
+			dc_tbl[i] = info->cur_comp_info[i]->dc_tbl_no;
+			ac_tbl[i] = info->cur_comp_info[i]->ac_tbl_no;
+			encoders[dc_class][dc_tbl[i]].build(*info->dc_huff_tbl_ptrs[dc_tbl[i]]);
+			encoders[ac_class][ac_tbl[i]].build(*info->ac_huff_tbl_ptrs[ac_tbl[i]]);
+		}
+		std::vector<mcu_block> blocks = mcu_blocks(info->cur_comp_info, info->comps_in_scan);
+		scan_rows rows = gather_rows(info, coeff, info->cur_comp_info, info->comps_in_scan);
+
+		std::size_t total_mcus = layout.mcus_per_row * layout.mcu_rows;
+		std::vector<char> ok(todo.size(), 0);
+		utils::parallel_for(todo.size(), [&](std::size_t t) {
+			std::size_t first = todo[t] * layout.restart_interval, last = std::min(total_mcus, first + layout.restart_interval);
+			symbol_writer out(coded[t], encoders);
+			ok[t] = code_mcus(out, blocks, rows, dc_tbl, ac_tbl, layout.mcus_per_row, first, last) && !out.missing;
+			out.reserve(16);
+			out.out.flush();
+		});
+		for(auto o : ok) {
+			if (!o) {
+				return {};
+			}
+		}
+	}
+
+	byte_vector result;
+	result.reserve(size + size/16);
+	//Headers up to the end of the SOS marker.
+	result.insert(result.end(), data, data + layout.segments.front().offset);
+	auto next = coded.begin();
+	for(std::size_t i=0; i<layout.segments.size(); ++i) {
+		segment const& seg = layout.segments[i];
+		if (dirty[i]) {
+			result.insert(result.end(), next->begin(), next->end());
+			byte_vector().swap(*next++);
+		} else {
+			result.insert(result.end(), data + seg.offset, data + seg.offset + seg.length);
+		}
+		//The following restart marker, or for the last interval whatever follows the scan.
+		std::size_t gap_end = i+1 < layout.segments.size() ? layout.segments[i+1].offset : size;
+		result.insert(result.end(), data + seg.offset + seg.length, data + gap_end);
+	}
+	return result;
+}
+
+}}}	//namespace zindorsky::steganography::jpeg
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "steg_defs.h"
+#include <cstdio>
+#include <jpeglib.h>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+namespace jpeg {
+
+//Entropy-coded bytes of one restart interval, as an offset into the compressed file.
+struct segment {
+	std::size_t offset, length;
+};
+
+//Where the restart intervals of a single-scan, Huffman coded JPEG lie in the compressed file.
+struct scan_layout {
+	std::size_t mcus_per_row = 0, mcu_rows = 0, restart_interval = 0;
+	std::vector<segment> segments;
+	//Offset of the marker (or fill bytes) that terminates the scan.
+	std::size_t end = 0;
+};
+
+//Splits the scan of a decompress object that has just read its header (via jpeg_mem_src over "data") into restart intervals.
+//Returns false if the image is progressive, arithmetic coded, multi-scan, has no restart markers, or the markers found don't match the header;
+//the caller should then fall back to jpeg_read_coefficients.
+bool find_restart_intervals(jpeg_decompress_struct * info, byte const* data, std::size_t size, scan_layout & layout);
+
+//Huffman decodes every restart interval in "layout" on multiple threads directly into coefficient arrays allocated from the decompress object.
+//The returned arrays are laid out the same way jpeg_read_coefficients lays them out.
+//Returns null if an interval turns out to be corrupt, leaving it to libjpeg to make what it can of the scan.
+jvirt_barray_ptr* decode_restart_intervals(jpeg_decompress_struct * info, byte const* data, scan_layout const& layout);
+
+//Encodes the coefficients of a decompress object as a complete baseline JPEG with a restart marker after every MCU row.
+//The rows are entropy coded on multiple threads, using Huffman tables optimized from the merged symbol counts of all threads.
+//Saved markers are copied as libjpeg's jpeg_write_coefficients path would copy them.
+//Returns an empty vector if the image can't be written this way (e.g. more than 4 components); the caller should then use libjpeg.
+byte_vector encode_restart_intervals(jpeg_decompress_struct * info, jvirt_barray_ptr* coeff);
+
+//Rebuilds the compressed file "data", whose scan is described by "layout", from the coefficient arrays. Intervals flagged in "dirty" are
+//re-encoded with the file's own Huffman tables; all other bytes are copied verbatim.
+//Returns an empty vector if a modified interval needs a code word the original tables don't have; the caller should then re-encode the whole image.
+byte_vector splice_restart_intervals(jpeg_decompress_struct * info, jvirt_barray_ptr* coeff, byte const* data, std::size_t size, scan_layout const& layout, std::vector<bool> const& dirty);
+
+}}}	//namespace zindorsky::steganography::jpeg
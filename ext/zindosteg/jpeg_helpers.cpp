@@ -1,27 +1,236 @@
 #include "jpeg_helpers.h"
 #include "file_utils.h"
+#include <csetjmp>
+#include <vector>
+#include <jerror.h>
 
 extern "C" void jpeglib_error_handler(j_common_ptr info)
 {
-	if(info) {
-		jpeg_abort(info);
+	if(!info) {
+		return;
 	}
-	//can't throw in extern "C" functions.
-//	throw steganography::jpeg::jpeg_exception(); 
+	//can't throw in extern "C" functions: jump back to jpeg::guarded, which does.
+	auto err = static_cast<zindorsky::steganography::jpeg::error_manager*>(info->err);
+	err->failed = true;
+	if (err->guard) {
+		std::longjmp(*err->guard, 1);
+	}
+	jpeg_abort(info);
 }
 
 namespace zindorsky {
 namespace steganography {
 namespace jpeg {
 
+error_manager::error_manager()
+	: jpeg_error_mgr{}
+{
+	jpeg_std_error(this);
+	error_exit = jpeglib_error_handler;
+}
+
+namespace {
+
+//libjpeg destination manager that compresses straight into a memory_sink.
+struct sink_destination : jpeg_destination_mgr {
+	explicit sink_destination(sink_writer & writer)
+		: writer_(writer)
+	{
+		init_destination = &sink_destination::init;
+		empty_output_buffer = &sink_destination::empty;
+		term_destination = &sink_destination::term;
+	}
+
+	sink_writer & writer_;
+	//size of the buffer last handed to libjpeg
+	std::size_t handed_out_ = 0;
+
+	//Growing the sink may throw, which mustn't go through libjpeg: that goes to the error manager instead.
+	static void hand_out(j_compress_ptr info, std::size_t min_size)
+	{
+		auto dest = static_cast<sink_destination*>(info->dest);
+		bool failed = false;
+		try {
+			dest->next_output_byte = dest->writer_.room(min_size);
+			dest->free_in_buffer = dest->handed_out_ = dest->writer_.capacity() - dest->writer_.used();
+		} catch(...) {
+			failed = true;
+		}
+		if (failed) {
+			ERREXIT(info, JERR_OUT_OF_MEMORY);
+		}
+	}
+
+	static void init(j_compress_ptr info)
+	{
+		hand_out(info, 1);
+	}
+
+	//Called when libjpeg has filled the whole buffer.
+	static boolean empty(j_compress_ptr info)
+	{
+		auto dest = static_cast<sink_destination*>(info->dest);
+		dest->writer_.advance(dest->handed_out_);
+		hand_out(info, dest->writer_.capacity());
+		return TRUE;
+	}
+
+	static void term(j_compress_ptr info)
+	{
+		auto dest = static_cast<sink_destination*>(info->dest);
+		dest->writer_.advance(dest->handed_out_ - dest->free_in_buffer);
+	}
+};
+
+//libjpeg destination manager that writes to an open file. Write failures are recorded rather than thrown through libjpeg.
+struct file_destination : jpeg_destination_mgr {
+	explicit file_destination(FILE * file)
+		: file_(file)
+	{
+		init_destination = &file_destination::init;
+		empty_output_buffer = &file_destination::empty;
+		term_destination = &file_destination::term;
+	}
+
+	FILE * file_;
+	bool failed_ = false;
+	JOCTET buffer_[0x10000];
+
+	void write(std::size_t size)
+	{
+		if (size && ::fwrite(buffer_, 1, size, file_) != size) {
+			failed_ = true;
+		}
+		next_output_byte = buffer_;
+		free_in_buffer = sizeof(buffer_);
+	}
+
+	static void init(j_compress_ptr info)
+	{
+		static_cast<file_destination*>(info->dest)->write(0);
+	}
+
+	static boolean empty(j_compress_ptr info)
+	{
+		static_cast<file_destination*>(info->dest)->write(sizeof(buffer_));
+		return TRUE;
+	}
+
+	static void term(j_compress_ptr info)
+	{
+		auto dest = static_cast<file_destination*>(info->dest);
+		dest->write(sizeof(buffer_) - dest->free_in_buffer);
+	}
+};
+
+//Set once either of this thread's pools has been destroyed, in case a libjpeg object outlives it (one held by a static cache, say).
+thread_local bool pools_gone = false;
+
+//libjpeg objects kept for later carriers on the same thread. jpeg_abort puts an object back in its just-created state: image memory is
+//released (into its arena), while the permanent pool, marker saving settings and source manager are kept.
+template<class Info>
+class codec_pool {
+public:
+	codec_pool() = default;
+
+	~codec_pool()
+	{
+		pools_gone = true;
+		for(auto & info : free_) {
+			info.err = &err_mgr_;
+			jpeg_destroy((j_common_ptr)&info);
+		}
+	}
+
+	//Fills in "info" with a pooled object, if there is one.
+	bool take(Info & info)
+	{
+		if (pools_gone || free_.empty()) {
+			return false;
+		}
+		info = free_.back();
+		free_.pop_back();
+		return true;
+	}
+
+	//Resets "info" and keeps it for reuse, or destroys it if the pool is full (or gone).
+	void give(Info & info)
+	{
+		if (pools_gone || free_.size() >= max_pooled) {
+			jpeg_destroy((j_common_ptr)&info);
+			return;
+		}
+		jpeg_abort((j_common_ptr)&info);
+		//the image memory of the biggest carrier the object held would otherwise stay with it
+		trim_image_memory((j_common_ptr)&info);
+		free_.push_back(info);
+	}
+
+private:
+	static const std::size_t max_pooled = 4;
+	std::vector<Info> free_;
+	//used when destroying pooled objects, whose owners' error managers are gone
+	error_manager err_mgr_;
+};
+
+thread_local codec_pool<jpeg_decompress_struct> decompress_pool;
+thread_local codec_pool<jpeg_compress_struct> compress_pool;
+
+//A compress object from the pool for the duration of one save. Objects from saves that didn't finish are destroyed rather than pooled.
+class compress_lease {
+public:
+	explicit compress_lease(error_manager & err_mgr)
+	{
+		info.err = &err_mgr;
+		if (!compress_pool.take(info)) {
+			guarded(err_mgr, [&] { jpeg_create_compress(&info); });
+			use_arena_memory((j_common_ptr)&info);
+		}
+		info.err = &err_mgr;
+	}
+
+	~compress_lease()
+	{
+		if (finished) {
+			compress_pool.give(info);
+		} else {
+			jpeg_destroy_compress(&info);
+		}
+	}
+
+	compress_lease(compress_lease const&) = delete;
+	compress_lease & operator = (compress_lease const&) = delete;
+
+	jpeg_compress_struct info;
+	bool finished = false;
+};
+
+//Size of the coefficient arrays jpeg_read_coefficients would allocate.
+std::size_t coefficient_bytes(jpeg_decompress_struct const* info)
+{
+	std::size_t bytes = 0;
+	for(int ci=0; ci<info->num_components; ++ci) {
+		jpeg_component_info const& comp = info->comp_info[ci];
+		std::size_t w = (comp.width_in_blocks + comp.h_samp_factor - 1) / comp.h_samp_factor * comp.h_samp_factor;
+		std::size_t h = (comp.height_in_blocks + comp.v_samp_factor - 1) / comp.v_samp_factor * comp.v_samp_factor;
+		bytes += w * h * sizeof(JBLOCK);
+	}
+	return bytes;
+}
+
+}	//namespace
+
 decompress_ctx::decompress_ctx( filesystem::path const& filename )
-	: decompress_ctx( utils::load_from_file(filename) )
+	: decompress_ctx( utils::shared_mapping::make(utils::mapped_file(filename)) )
 {
 }
 
 decompress_ctx::decompress_ctx(byte const* data, size_t size)
-	: decompress_ctx( byte_vector(data, data+size) ) 
 {
+	read(data, size);
+	if (!dirty_.empty()) {
+		original_.assign(data, data+size);
+	}
 }
 
 decompress_ctx::decompress_ctx(byte_vector const& data)
@@ -30,25 +239,70 @@ decompress_ctx::decompress_ctx(byte_vector const& data)
 }
 
 decompress_ctx::decompress_ctx(byte_vector && data)
-	: data_(std::move(data))
 {
-	info_.err = jpeg_std_error(&err_mgr_);
-	err_mgr_.error_exit = jpeglib_error_handler;
+	read(data.data(), data.size());
+	if (!dirty_.empty()) {
+		original_ = std::move(data);
+	}
+}
+
+decompress_ctx::decompress_ctx(std::shared_ptr<utils::shared_mapping> const& file)
+{
+	byte_span bytes = file->bytes();
+	read(bytes.data(), bytes.size());
+	if (!dirty_.empty()) {
+		original_file_ = file;
+	}
+}
 
-	jpeg_create_decompress(&info_);
-	//save markers for writing later
-	jpeg_save_markers(&info_,JPEG_COM,0xffff);
-	for(int i=1; i<=15; ++i) {
-		jpeg_save_markers(&info_,JPEG_APP0+i,0xffff);
+void decompress_ctx::read(byte const* data, size_t size)
+{
+	input_sz_ = size;
+	info_.err = &err_mgr_;
+
+	//pooled objects already have everything below set up
+	if (decompress_pool.take(info_)) {
+		info_.err = &err_mgr_;
+	} else {
+		guarded(err_mgr_, [&] { jpeg_create_decompress(&info_); });
+		use_arena_memory((j_common_ptr)&info_);
+		//save markers for writing later (libjpeg copies them into its own memory)
+		guarded(err_mgr_, [&] {
+			jpeg_save_markers(&info_,JPEG_COM,0xffff);
+			for(int i=1; i<=15; ++i) {
+				jpeg_save_markers(&info_,JPEG_APP0+i,0xffff);
+			}
+		});
 	}
+	std::size_t budget = memory_budget();
+	info_.mem->max_memory_to_use = static_cast<long>(budget);
 
 	try {
-		jpeg_mem_src(&info_, data_.data(), static_cast<unsigned long>(data_.size()));
-		jpeg_read_header(&info_,TRUE);
-		coeff_ = jpeg_read_coefficients(&info_);
+		guarded(err_mgr_, [&] {
+			jpeg_mem_src(&info_, data, static_cast<unsigned long>(size));
+			jpeg_read_header(&info_,TRUE);
+		});
+		//If the scan is split by restart markers, decode the intervals in parallel. Otherwise let libjpeg do it.
+		//The parallel decoder needs every coefficient in memory at once, so it's only used when they fit the budget.
+		coeff_ = nullptr;
+		if ((!budget || coefficient_bytes(&info_) <= budget) && find_restart_intervals(&info_, data, size, layout_)) {
+			coeff_ = decode_restart_intervals(&info_, data, layout_);
+			if (!coeff_) {
+				discard_virt_arrays((j_common_ptr)&info_);
+			}
+		}
+		if (coeff_) {
+			dirty_.assign(layout_.segments.size(), false);
+		} else {
+			layout_ = scan_layout{};
+			guarded(err_mgr_, [&] { coeff_ = jpeg_read_coefficients(&info_); });
+		}
 		if(!coeff_) {
 			throw jpeg_exception();
 		}
+		//Nothing reads the compressed data from here on.
+		info_.src->next_input_byte = nullptr;
+		info_.src->bytes_in_buffer = 0;
 	} catch(...) {
 		jpeg_destroy_decompress(&info_);
 		throw;
@@ -56,94 +310,153 @@ decompress_ctx::decompress_ctx(byte_vector && data)
 }
 
 decompress_ctx::decompress_ctx(decompress_ctx && rhs)
-	: data_( std::move(rhs.data_) )
+	: original_( std::move(rhs.original_) )
+	, original_file_( std::move(rhs.original_file_) )
+	, input_sz_( rhs.input_sz_ )
 	, err_mgr_( std::move(rhs.err_mgr_) )
 	, info_{0}
 	, coeff_( std::move(rhs.coeff_) )
+	, layout_( std::move(rhs.layout_) )
+	, dirty_( std::move(rhs.dirty_) )
 {
 	std::swap(info_, rhs.info_);
+	info_.err = &err_mgr_;
+	rhs.info_.err = &rhs.err_mgr_;
 }
 
 decompress_ctx & decompress_ctx::operator = (decompress_ctx && rhs)
 {
-	data_ = std::move(rhs.data_);
+	original_ = std::move(rhs.original_);
+	original_file_ = std::move(rhs.original_file_);
+	input_sz_ = rhs.input_sz_;
 	err_mgr_ = std::move(rhs.err_mgr_);
 	std::swap(info_, rhs.info_);
+	info_.err = &err_mgr_;
+	rhs.info_.err = &rhs.err_mgr_;
 	coeff_ = std::move(rhs.coeff_);
+	layout_ = std::move(rhs.layout_);
+	dirty_ = std::move(rhs.dirty_);
 	return *this;
 }
 
 decompress_ctx::~decompress_ctx()
 {
 	if (info_.src) {
-		jpeg_destroy_decompress(&info_);
+		decompress_pool.give(info_);
 	}
 }
 
-void decompress_ctx::save_to_file( filesystem::path const& filename )
+memory_usage decompress_ctx::memory_usage() const
 {
-	FILE* file = ::fopen( filename.c_str(), "wb" );
-	if(!file) {
-		throw std::ios_base::failure("file open fail");
-	}
+	return get_memory_usage((j_common_ptr)&info_);
+}
 
-	jpeg_error_mgr err_mgr;
-	jpeg_compress_struct info;
+void decompress_ctx::touch(std::size_t comp, std::size_t row, std::size_t col)
+{
+	if (dirty_.empty()) {
+		return;
+	}
+	std::size_t mcu;
+	if (info_.comps_in_scan == 1) {
+		mcu = row * layout_.mcus_per_row + col;
+	} else {
+		jpeg_component_info const& c = info_.comp_info[comp];
+		mcu = (row / c.v_samp_factor) * layout_.mcus_per_row + col / c.h_samp_factor;
+	}
+	dirty_[mcu / layout_.restart_interval] = true;
+}
 
-	info.err = jpeg_std_error(&err_mgr);
-	err_mgr.error_exit = jpeglib_error_handler;
+byte_vector decompress_ctx::encode(bool parallel)
+{
+	//The restart interval encoders hold on to every row at once, which paged coefficients don't allow.
+	if (memory_usage().spilled) {
+		return {};
+	}
+	//Splicing keeps the original tables and markers byte for byte, so prefer it whenever it works.
+	if (!dirty_.empty()) {
+		byte_span original = original_file_ ? original_file_->bytes() : byte_span(original_.data(), original_.size());
+		byte_vector data = splice_restart_intervals(object(), coefficients(), original.data(), original.size(), layout_, dirty_);
+		if (!data.empty()) {
+			return data;
+		}
+	}
+	if (parallel) {
+		return encode_restart_intervals(object(), coefficients());
+	}
+	return {};
+}
 
-	jpeg_create_compress(&info);
+void decompress_ctx::compress(jpeg_destination_mgr * dest)
+{
+	error_manager err_mgr;
+	compress_lease lease(err_mgr);
+	jpeg_compress_struct & info = lease.info;
 	info.optimize_coding = TRUE;
+	info.dest = dest;
 
-	jpeg_stdio_dest(&info, file);
-
-	jpeg_copy_critical_parameters(object(), &info);
-	jpeg_write_coefficients(&info, coefficients());
-	//copy markers and comments
-	for(jpeg_saved_marker_ptr curr=object()->marker_list; curr; curr=curr->next) {
-		if(curr->data && curr->data_length>0)
-			jpeg_write_marker(&info, curr->marker, curr->data, curr->data_length);
+	guarded(err_mgr, [&] {
+		jpeg_copy_critical_parameters(object(), &info);
+		jpeg_write_coefficients(&info, coefficients());
+		//copy markers and comments
+		for(jpeg_saved_marker_ptr curr=object()->marker_list; curr; curr=curr->next) {
+			if(curr->data && curr->data_length>0)
+				jpeg_write_marker(&info, curr->marker, curr->data, curr->data_length);
+		}
+		jpeg_finish_compress(&info);
+	});
+	//an error outside of guarded only got recorded
+	if (err_mgr.failed) {
+		throw jpeg_exception();
 	}
-	jpeg_finish_compress(&info);
-	jpeg_destroy_compress(&info);
-	::fclose(file);
+	lease.finished = true;
 }
 
-byte_vector decompress_ctx::save_to_memory()
+void decompress_ctx::save_to_file( filesystem::path const& filename, bool parallel )
 {
-	byte *mem = nullptr;
-	unsigned long memsz = 0;
-
-	jpeg_error_mgr err_mgr;
-	jpeg_compress_struct info;
-
-	info.err = jpeg_std_error(&err_mgr);
-	err_mgr.error_exit = jpeglib_error_handler;
-
-	jpeg_create_compress(&info);
-	info.optimize_coding = TRUE;
+	//The file is written in place, under any mapping of it (ours included).
+	utils::detach_shared_mappings(filename);
+	byte_vector data = encode(parallel);
+	if (!data.empty()) {
+		utils::save_to_file(filename, data);
+		return;
+	}
 
-	jpeg_mem_dest(&info, &mem, &memsz);
+	FILE* file = ::fopen( filename.c_str(), "wb" );
+	if(!file) {
+		throw std::ios_base::failure("file open fail");
+	}
 
-	jpeg_copy_critical_parameters(object(), &info);
-	jpeg_write_coefficients(&info, coefficients());
-	//copy markers and comments
-	for(jpeg_saved_marker_ptr curr=object()->marker_list; curr; curr=curr->next) {
-		if(curr->data && curr->data_length>0)
-			jpeg_write_marker(&info, curr->marker, curr->data, curr->data_length);
+	file_destination dest(file);
+	try {
+		compress(&dest);
+	} catch(...) {
+		::fclose(file);
+		throw;
+	}
+	if (::fclose(file) != 0 || dest.failed_) {
+		throw std::ios_base::failure("file write fail");
 	}
-	jpeg_finish_compress(&info);
-	jpeg_destroy_compress(&info);
+}
+
+byte_vector decompress_ctx::save_to_memory( bool parallel )
+{
+	vector_sink sink;
+	save_to_memory(sink, parallel);
+	return sink.release();
+}
 
-	if (mem && memsz) {
-		byte_vector result{ mem, mem + memsz };
-		::free(mem);
-		return result;
+void decompress_ctx::save_to_memory( memory_sink & sink, bool parallel )
+{
+	byte_vector data = encode(parallel);
+	if (!data.empty()) {
+		sink.adopt(std::move(data));
+		return;
 	}
 
-	return{};
+	sink_writer writer(sink, input_sz_ + input_sz_/8);
+	sink_destination dest(writer);
+	compress(&dest);
+	writer.finish();
 }
 
 }}}	//namespace zindorsky::steganography::jpeg
-
@@ -2,8 +2,14 @@
 #define steganography_jpeg_helpers_h_included
 
 #include "steg_defs.h"
+#include "jpeg_entropy.h"
+#include "memory_sink.h"
+#include "jpeg_memory.h"
+#include "mapped_file.h"
+#include <csetjmp>
 #include <cstdio>
 #include <jpeglib.h>
+#include <memory>
 #include <vector>
 
 //error handling callback for jpeg lib
@@ -18,12 +24,41 @@ public:
 	jpeg_exception() : std::runtime_error("JPEG file error") {}
 };
 
+//Error manager of our libjpeg objects. libjpeg's error_exit must not return, so inside jpeg::guarded it jumps back there instead.
+//Anywhere else (destroying pooled objects, say) the error is only recorded and the object aborted.
+struct error_manager : jpeg_error_mgr {
+	error_manager();
+
+	bool failed = false;
+	std::jmp_buf * guard = nullptr;
+};
+
+//Calls "f", which calls into libjpeg, and throws jpeg_exception if libjpeg reported an error. An error jumps straight out of "f", so
+//nothing it does may need destroying: only libjpeg calls go in there.
+template<class F>
+void guarded(error_manager & err, F const& f)
+{
+	std::jmp_buf env;
+	std::jmp_buf * outer = err.guard;
+	err.guard = &env;
+	if (setjmp(env)) {
+		err.guard = outer;
+		throw jpeg_exception();
+	}
+	f();
+	err.guard = outer;
+}
+
+//Decoded coefficients of a JPEG. The compressed input isn't needed once the constructor returns, except that carriers with restart intervals
+//keep the original file to splice unchanged intervals from when saving: the mapping, when they're decoded from one, otherwise a copy.
+//libjpeg objects, both this one and the compress objects used for saving, are drawn from and returned to per-thread pools.
 class decompress_ctx {
 public:
 	explicit decompress_ctx( filesystem::path const& filename );
 	decompress_ctx(byte const* data, size_t size);
 	explicit decompress_ctx(byte_vector const& data);
 	explicit decompress_ctx(byte_vector && data);
+	explicit decompress_ctx(std::shared_ptr<utils::shared_mapping> const& file);
 
 	//Non-copyable
 	decompress_ctx(decompress_ctx const&) = delete;
@@ -38,14 +73,36 @@ public:
 
 	jvirt_barray_ptr* coefficients() const { return coeff_; }
 
-	void save_to_file( filesystem::path const& filename );
-	byte_vector save_to_memory();
+	//How much of the coefficient data is in memory and how much was paged out to keep within jpeg::set_memory_budget.
+	jpeg::memory_usage memory_usage() const;
+	//Bytes of the original file held in memory (rather than mapped) for splicing.
+	std::size_t original_in_memory() const { return original_.size(); }
+
+	//Records that the coefficient block at (row,col) of component "comp" is about to be modified.
+	//When the carrier has restart intervals, saving re-encodes only the intervals that were touched.
+	void touch(std::size_t comp, std::size_t row, std::size_t col);
+
+	//If "parallel" is true, the output gets a restart marker after every MCU row and the rows are entropy coded on multiple threads.
+	void save_to_file( filesystem::path const& filename, bool parallel = false );
+	byte_vector save_to_memory( bool parallel = false );
+	void save_to_memory( memory_sink & sink, bool parallel = false );
 
 private:
-	byte_vector data_;
-	jpeg_error_mgr err_mgr_;
+	byte_vector original_;
+	std::shared_ptr<utils::shared_mapping> original_file_;
+	//Size of the compressed input; a good first guess at the size of the output.
+	std::size_t input_sz_;
+	error_manager err_mgr_;
 	jpeg_decompress_struct info_;
 	jvirt_barray_ptr *coeff_;
+	//Restart intervals of the original scan (if it has them) and which ones have been touched.
+	scan_layout layout_;
+	std::vector<bool> dirty_;
+
+	void read(byte const* data, size_t size);
+	//Re-encodes the coefficients with libjpeg.
+	void compress(jpeg_destination_mgr * dest);
+	byte_vector encode(bool parallel);
 };
 
 }}}	//namespace zindorsky::steganography::jpeg
@@ -0,0 +1,725 @@
+#include "jpeg_memory.h"
+#include "jpeg_helpers.h"
+#include "file_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <jerror.h>
+#if defined(__linux__)
+# include <sys/mman.h>
+#endif
+
+namespace zindorsky {
+namespace steganography {
+namespace jpeg {
+
+namespace {
+
+//Every allocation is aligned for libjpeg-turbo's SIMD code.
+const std::size_t alignment = 64;
+const std::size_t min_block_sz = std::size_t(1) << 20;
+const std::size_t huge_page_sz = std::size_t(2) << 20;
+//Smallest band of a paged virtual array that is read or written at once.
+const std::size_t min_band_sz = std::size_t(16) << 10;
+//How much memory a cached arena may keep between carriers, and how many arenas a thread keeps.
+const std::size_t max_retained_sz = std::size_t(128) << 20;
+const std::size_t max_cached_arenas = 4;
+
+std::atomic<bool> huge_pages{false};
+std::atomic<std::size_t> default_budget{0};
+
+//Thrown by the memory manager's methods with the libjpeg error code to report.
+class memory_error : public jpeg_exception {
+public:
+	explicit memory_error(int code) : code(code) {}
+	int code;
+};
+
+std::size_t round_up(std::size_t n, std::size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+//Bump allocator whose blocks survive reset().
+class arena {
+public:
+	arena() = default;
+	arena(arena const&) = delete;
+	arena & operator = (arena const&) = delete;
+
+	~arena()
+	{
+		for(auto & b : blocks_) {
+			release(b);
+		}
+	}
+
+	void * allocate(std::size_t size)
+	{
+		size = round_up(size ? size : 1, alignment);
+		if (blocks_.empty() || blocks_[current_].size - used_ < size) {
+			next_block(size);
+		}
+		void * p = blocks_[current_].data + used_;
+		used_ += size;
+		return p;
+	}
+
+	void reset()
+	{
+		current_ = 0;
+		used_ = 0;
+	}
+
+	//Frees blocks, largest first, until no more than "keep" bytes are held. Only call on a reset arena.
+	void trim(std::size_t keep)
+	{
+		std::sort(blocks_.begin(), blocks_.end(), [](block const& a, block const& b) { return a.size < b.size; });
+		while(!blocks_.empty() && capacity() > keep) {
+			release(blocks_.back());
+			blocks_.pop_back();
+		}
+	}
+
+	std::size_t capacity() const
+	{
+		std::size_t sz = 0;
+		for(auto const& b : blocks_) {
+			sz += b.size;
+		}
+		return sz;
+	}
+
+private:
+	struct block {
+		byte * data;
+		std::size_t size;
+		bool mapped;
+	};
+
+	//Blocks before current_ are full, blocks after it are free.
+	std::vector<block> blocks_;
+	std::size_t current_ = 0, used_ = 0;
+
+	void next_block(std::size_t size)
+	{
+		std::size_t next = blocks_.empty() ? 0 : current_ + 1;
+		//reuse a free block if one is big enough
+		for(std::size_t i=next; i<blocks_.size(); ++i) {
+			if (blocks_[i].size >= size) {
+				std::swap(blocks_[next], blocks_[i]);
+				current_ = next;
+				used_ = 0;
+				return;
+			}
+		}
+		blocks_.insert(blocks_.begin() + next, acquire(std::max(size, min_block_sz)));
+		current_ = next;
+		used_ = 0;
+	}
+
+	static block acquire(std::size_t size)
+	{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		if (size >= huge_page_sz && huge_pages.load(std::memory_order_relaxed)) {
+			size = round_up(size, huge_page_sz);
+			//over-map so that the block can start on a huge page boundary
+			void * p = ::mmap(nullptr, size + huge_page_sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				throw std::bad_alloc();
+			}
+			byte * base = static_cast<byte*>(p);
+			byte * aligned = reinterpret_cast<byte*>( round_up(reinterpret_cast<std::uintptr_t>(base), huge_page_sz) );
+			if (aligned > base) {
+				::munmap(base, aligned - base);
+			}
+			::munmap(aligned + size, base + huge_page_sz - aligned);
+			::madvise(aligned, size, MADV_HUGEPAGE);
+			return block{aligned, size, true};
+		}
+#endif
+		size = round_up(size, alignment);
+		void * p = std::aligned_alloc(alignment, size);
+		if (!p) {
+			throw std::bad_alloc();
+		}
+		return block{static_cast<byte*>(p), size, false};
+	}
+
+	static void release(block const& b)
+	{
+#if defined(__linux__)
+		if (b.mapped) {
+			::munmap(b.data, b.size);
+			return;
+		}
+#endif
+		std::free(b.data);
+	}
+};
+
+struct arena_set {
+	arena pools[JPOOL_NUMPOOLS];
+};
+
+//Set once this thread's cache has been destroyed, in case a libjpeg object outlives it.
+thread_local bool cache_gone = false;
+
+//Arenas waiting for the next libjpeg object created on this thread.
+class arena_cache {
+public:
+	arena_cache() = default;
+	~arena_cache() { cache_gone = true; }
+
+	std::unique_ptr<arena_set> get()
+	{
+		if (free_.empty()) {
+			return std::make_unique<arena_set>();
+		}
+		std::unique_ptr<arena_set> a = std::move(free_.back());
+		free_.pop_back();
+		return a;
+	}
+
+	void put(std::unique_ptr<arena_set> a)
+	{
+		if (free_.size() >= max_cached_arenas) {
+			return;
+		}
+		for(auto & pool : a->pools) {
+			pool.reset();
+			pool.trim(max_retained_sz);
+		}
+		free_.push_back(std::move(a));
+	}
+
+private:
+	std::vector<std::unique_ptr<arena_set>> free_;
+};
+
+thread_local arena_cache cache;
+
+//Temp file holding the parts of virtual arrays that don't fit the memory budget.
+class backing_store {
+public:
+	backing_store() = default;
+	backing_store(backing_store const&) = delete;
+	backing_store & operator = (backing_store const&) = delete;
+	~backing_store() { close(); }
+
+	void close()
+	{
+		if (file_) {
+			std::fclose(file_);
+			file_ = nullptr;
+		}
+		size_ = 0;
+	}
+
+	//Reserves "size" bytes of the file and returns their offset.
+	std::size_t reserve(std::size_t size)
+	{
+		if (!file_ && !(file_ = std::tmpfile())) {
+			throw memory_error(JERR_TFILE_CREATE);
+		}
+		std::size_t offset = size_;
+		size_ += size;
+		return offset;
+	}
+
+	void write(std::size_t offset, void const* data, std::size_t size)
+	{
+		if (!utils::seek_file(file_, offset) || std::fwrite(data, 1, size, file_) != size) {
+			throw memory_error(JERR_TFILE_WRITE);
+		}
+	}
+
+	//Bytes past the end of what has been written read as zeros. Returns how many bytes came from the file.
+	std::size_t read(std::size_t offset, void * data, std::size_t size)
+	{
+		std::size_t r = 0;
+		if (utils::seek_file(file_, offset)) {
+			r = std::fread(data, 1, size, file_);
+		}
+		std::clearerr(file_);
+		std::memset(static_cast<byte*>(data) + r, 0, size - r);
+		return r;
+	}
+
+private:
+	std::FILE * file_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+struct arena_memory_mgr;
+
+//Rows of a virtual array that didn't fit the budget. The array is split into bands of at least "maxaccess" rows, a few of which are
+//resident at a time; the rest live in the backing store. Bands are evicted by the clock algorithm, which works well both for libjpeg's
+//sequential passes and for the scattered single-row accesses steganography makes.
+struct band_cache {
+	static constexpr std::uint32_t none = ~std::uint32_t(0);
+
+	struct slot {
+		byte * data;
+		std::uint32_t band;
+		bool dirty, referenced;
+	};
+
+	arena_memory_mgr * owner;
+	std::size_t offset, row_bytes;
+	JDIMENSION rows, band_rows;
+	slot * slots;
+	std::size_t slot_count, hand;
+	//slot holding each band, or none
+	std::uint32_t * band_slot;
+
+	JDIMENSION rows_in_band(std::uint32_t band) const
+	{
+		return std::min(band_rows, rows - band * band_rows);
+	}
+
+	//Makes rows [start,end) resident and points their entries in "row_ptrs" at them.
+	template<class Row>
+	void fetch(Row * row_ptrs, JDIMENSION start, JDIMENSION end, bool writable, JDIMENSION first_undef_row)
+	{
+		std::uint32_t first = start / band_rows, last = (end - 1) / band_rows;
+		for(std::uint32_t b = first; b <= last; ++b) {
+			std::uint32_t s = band_slot[b];
+			if (s == none) {
+				s = load(row_ptrs, b, first, last, first_undef_row);
+			}
+			slots[s].referenced = true;
+			if (writable) {
+				slots[s].dirty = true;
+			}
+		}
+	}
+
+	template<class Row>
+	std::uint32_t load(Row * row_ptrs, std::uint32_t band, std::uint32_t pinned_first, std::uint32_t pinned_last, JDIMENSION first_undef_row);
+
+	//Picks a slot to reuse, never one holding a band in [pinned_first,pinned_last].
+	std::uint32_t victim(std::uint32_t pinned_first, std::uint32_t pinned_last)
+	{
+		for(;;) {
+			std::uint32_t s = static_cast<std::uint32_t>(hand);
+			hand = (hand + 1) % slot_count;
+			slot & sl = slots[s];
+			if (sl.band == none) {
+				return s;
+			}
+			if (sl.band >= pinned_first && sl.band <= pinned_last) {
+				continue;
+			}
+			if (sl.referenced) {
+				sl.referenced = false;
+				continue;
+			}
+			return s;
+		}
+	}
+};
+
+//libjpeg only ever sees pointers to these as its opaque jvirt_sarray_ptr/jvirt_barray_ptr types.
+template<class Row>
+struct virtual_array {
+	//Pointers to every row. Rows of a paged array that aren't resident are null.
+	Row * mem_buffer;
+	JDIMENSION rows_in_array, width, maxaccess, first_undef_row;
+	boolean pre_zero;
+	virtual_array * next;
+	//Only set for arrays that didn't fit the budget.
+	band_cache * bands;
+};
+
+using sample_array = virtual_array<JSAMPROW>;
+using block_array = virtual_array<JBLOCKROW>;
+
+struct arena_memory_mgr {
+	//Must come first: libjpeg only knows about this part.
+	jpeg_memory_mgr pub;
+	//libjpeg's own manager, which still owns whatever jpeg_create_* allocated before we took over.
+	jpeg_memory_mgr * original;
+	std::unique_ptr<arena_set> arenas;
+	sample_array * sarrays;
+	block_array * barrays;
+	backing_store store;
+	memory_usage usage;
+};
+
+template<class Row>
+std::uint32_t band_cache::load(Row * row_ptrs, std::uint32_t band, std::uint32_t pinned_first, std::uint32_t pinned_last, JDIMENSION first_undef_row)
+{
+	std::uint32_t s = victim(pinned_first, pinned_last);
+	slot & sl = slots[s];
+	if (sl.band != none) {
+		JDIMENSION r0 = sl.band * band_rows, n = rows_in_band(sl.band);
+		if (sl.dirty) {
+			owner->store.write(offset + r0 * row_bytes, sl.data, n * row_bytes);
+			owner->usage.bytes_written += n * row_bytes;
+		}
+		for(JDIMENSION r=r0; r<r0+n; ++r) {
+			row_ptrs[r] = nullptr;
+		}
+		band_slot[sl.band] = none;
+	}
+
+	JDIMENSION r0 = band * band_rows, n = rows_in_band(band);
+	//rows nobody has written yet have no contents to read back
+	if (r0 < first_undef_row) {
+		owner->usage.bytes_read += owner->store.read(offset + r0 * row_bytes, sl.data, n * row_bytes);
+	}
+	for(JDIMENSION r=r0; r<r0+n; ++r) {
+		row_ptrs[r] = reinterpret_cast<Row>(sl.data + (r - r0) * row_bytes);
+	}
+	sl.band = band;
+	sl.dirty = false;
+	band_slot[band] = s;
+	return s;
+}
+
+arena_memory_mgr * manager(j_common_ptr info)
+{
+	return reinterpret_cast<arena_memory_mgr*>(info->mem);
+}
+
+void * alloc_small(j_common_ptr info, int pool_id, std::size_t size)
+{
+	if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+		throw memory_error(JERR_BAD_POOL_ID);
+	}
+	return manager(info)->arenas->pools[pool_id].allocate(size);
+}
+
+//libjpeg-turbo pads sample rows so SIMD code can run past the end of a row
+std::size_t sample_row_bytes(JDIMENSION samplesperrow)
+{
+	return round_up(samplesperrow * sizeof(JSAMPLE), alignment);
+}
+
+std::size_t block_row_bytes(JDIMENSION blocksperrow)
+{
+	return std::size_t(blocksperrow) * sizeof(JBLOCK);
+}
+
+template<class Row>
+Row * alloc_rows(j_common_ptr info, int pool_id, std::size_t row_bytes, JDIMENSION numrows)
+{
+	Row * result = static_cast<Row*>( alloc_small(info, pool_id, numrows * sizeof(Row)) );
+	byte * rows = static_cast<byte*>( alloc_small(info, pool_id, numrows * row_bytes) );
+	for(JDIMENSION i=0; i<numrows; ++i) {
+		result[i] = reinterpret_cast<Row>(rows + i * row_bytes);
+	}
+	return result;
+}
+
+JSAMPARRAY alloc_sarray(j_common_ptr info, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows)
+{
+	return alloc_rows<JSAMPROW>(info, pool_id, sample_row_bytes(samplesperrow), numrows);
+}
+
+JBLOCKARRAY alloc_barray(j_common_ptr info, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows)
+{
+	return alloc_rows<JBLOCKROW>(info, pool_id, block_row_bytes(blocksperrow), numrows);
+}
+
+template<class Array>
+Array * request_virt(j_common_ptr info, int pool_id, boolean pre_zero, JDIMENSION width, JDIMENSION numrows, JDIMENSION maxaccess, Array *& list)
+{
+	//virtual arrays must live in the image pool
+	if (pool_id != JPOOL_IMAGE) {
+		throw memory_error(JERR_BAD_POOL_ID);
+	}
+	Array * result = static_cast<Array*>( alloc_small(info, pool_id, sizeof(Array)) );
+	result->mem_buffer = nullptr;
+	result->rows_in_array = numrows;
+	result->width = width;
+	result->maxaccess = maxaccess;
+	result->first_undef_row = 0;
+	result->pre_zero = pre_zero;
+	result->next = list;
+	result->bands = nullptr;
+	list = result;
+	return result;
+}
+
+jvirt_sarray_ptr request_virt_sarray(j_common_ptr info, int pool_id, boolean pre_zero, JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+	return reinterpret_cast<jvirt_sarray_ptr>( request_virt(info, pool_id, pre_zero, samplesperrow, numrows, maxaccess, manager(info)->sarrays) );
+}
+
+jvirt_barray_ptr request_virt_barray(j_common_ptr info, int pool_id, boolean pre_zero, JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+	return reinterpret_cast<jvirt_barray_ptr>( request_virt(info, pool_id, pre_zero, blocksperrow, numrows, maxaccess, manager(info)->barrays) );
+}
+
+//Gives an array its memory: all of it, or if "share" bytes aren't enough, a band cache backed by the temp file.
+template<class Row>
+void realize(j_common_ptr info, virtual_array<Row> * a, std::size_t row_bytes, std::size_t share, bool page)
+{
+	arena_memory_mgr * mgr = manager(info);
+	std::size_t total = a->rows_in_array * row_bytes;
+	if (page && a->rows_in_array > 0) {
+		JDIMENSION band_rows = static_cast<JDIMENSION>( std::max<std::size_t>(a->maxaccess, (min_band_sz + row_bytes - 1) / row_bytes) );
+		band_rows = std::min(band_rows, a->rows_in_array);
+		std::size_t band_bytes = band_rows * row_bytes;
+		std::size_t band_count = (a->rows_in_array + band_rows - 1) / band_rows;
+		std::size_t slot_count = std::max<std::size_t>(2, share / band_bytes);
+		if (slot_count < band_count) {
+			a->mem_buffer = static_cast<Row*>( alloc_small(info, JPOOL_IMAGE, a->rows_in_array * sizeof(Row)) );
+			std::fill(a->mem_buffer, a->mem_buffer + a->rows_in_array, nullptr);
+
+			band_cache * c = static_cast<band_cache*>( alloc_small(info, JPOOL_IMAGE, sizeof(band_cache)) );
+			c->owner = mgr;
+			c->offset = mgr->store.reserve(total);
+			c->row_bytes = row_bytes;
+			c->rows = a->rows_in_array;
+			c->band_rows = band_rows;
+			c->slot_count = slot_count;
+			c->hand = 0;
+			c->slots = static_cast<band_cache::slot*>( alloc_small(info, JPOOL_IMAGE, slot_count * sizeof(band_cache::slot)) );
+			byte * data = static_cast<byte*>( alloc_small(info, JPOOL_IMAGE, slot_count * band_bytes) );
+			for(std::size_t i=0; i<slot_count; ++i) {
+				c->slots[i] = band_cache::slot{data + i * band_bytes, band_cache::none, false, false};
+			}
+			c->band_slot = static_cast<std::uint32_t*>( alloc_small(info, JPOOL_IMAGE, band_count * sizeof(std::uint32_t)) );
+			std::fill(c->band_slot, c->band_slot + band_count, band_cache::none);
+			a->bands = c;
+
+			mgr->usage.in_memory += slot_count * band_bytes;
+			mgr->usage.spilled += total;
+			return;
+		}
+	}
+	a->mem_buffer = alloc_rows<Row>(info, JPOOL_IMAGE, row_bytes, a->rows_in_array);
+	mgr->usage.in_memory += total;
+}
+
+void realize_virt_arrays(j_common_ptr info)
+{
+	arena_memory_mgr * mgr = manager(info);
+
+	//Like libjpeg, share whatever is left of the budget among the new arrays in proportion to their size.
+	std::size_t needed = 0;
+	for(sample_array * a = mgr->sarrays; a; a = a->next) {
+		if (!a->mem_buffer) {
+			needed += a->rows_in_array * sample_row_bytes(a->width);
+		}
+	}
+	for(block_array * a = mgr->barrays; a; a = a->next) {
+		if (!a->mem_buffer) {
+			needed += a->rows_in_array * block_row_bytes(a->width);
+		}
+	}
+	std::size_t budget = mgr->pub.max_memory_to_use > 0 ? static_cast<std::size_t>(mgr->pub.max_memory_to_use) : 0;
+	std::size_t available = budget > mgr->usage.in_memory ? budget - mgr->usage.in_memory : 0;
+	bool page = budget && needed > available;
+	mgr->usage.budget = budget;
+
+	auto share = [&](std::size_t bytes) {
+		return needed ? static_cast<std::size_t>( static_cast<double>(available) * bytes / needed ) : 0;
+	};
+	for(sample_array * a = mgr->sarrays; a; a = a->next) {
+		if (!a->mem_buffer) {
+			std::size_t row_bytes = sample_row_bytes(a->width);
+			realize(info, a, row_bytes, share(a->rows_in_array * row_bytes), page);
+		}
+	}
+	for(block_array * a = mgr->barrays; a; a = a->next) {
+		if (!a->mem_buffer) {
+			std::size_t row_bytes = block_row_bytes(a->width);
+			realize(info, a, row_bytes, share(a->rows_in_array * row_bytes), page);
+		}
+	}
+}
+
+//Same rules as libjpeg's access_virt_*: writers go forward without gaps, readers may only look at rows that were written or pre-zeroed.
+//For paged arrays, the rows returned stay valid until the next access to the same array.
+template<class Array>
+typename std::remove_pointer<decltype(Array::mem_buffer)>::type * access_virt(Array * a, JDIMENSION start_row, JDIMENSION num_rows, boolean writable, std::size_t row_bytes)
+{
+	JDIMENSION end_row = start_row + num_rows;
+	if (end_row > a->rows_in_array || num_rows > a->maxaccess || !a->mem_buffer) {
+		throw memory_error(JERR_BAD_VIRTUAL_ACCESS);
+	}
+	if (a->bands && num_rows > 0) {
+		a->bands->fetch(a->mem_buffer, start_row, end_row, writable != FALSE, a->first_undef_row);
+	}
+	if (a->first_undef_row < end_row) {
+		JDIMENSION undef_row;
+		if (a->first_undef_row < start_row) {
+			if (writable) {
+				throw memory_error(JERR_BAD_VIRTUAL_ACCESS);
+			}
+			undef_row = start_row;
+		} else {
+			undef_row = a->first_undef_row;
+		}
+		if (writable) {
+			a->first_undef_row = end_row;
+		}
+		if (a->pre_zero) {
+			//arena memory is recycled, so zeroing can't be skipped
+			for(JDIMENSION r=undef_row; r<end_row; ++r) {
+				std::memset(a->mem_buffer[r], 0, row_bytes);
+			}
+		} else if (!writable) {
+			throw memory_error(JERR_BAD_VIRTUAL_ACCESS);
+		}
+	}
+	return a->mem_buffer + start_row;
+}
+
+JSAMPARRAY access_virt_sarray(j_common_ptr, jvirt_sarray_ptr ptr, JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	sample_array * a = reinterpret_cast<sample_array*>(ptr);
+	return access_virt(a, start_row, num_rows, writable, a->width * sizeof(JSAMPLE));
+}
+
+JBLOCKARRAY access_virt_barray(j_common_ptr, jvirt_barray_ptr ptr, JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	block_array * a = reinterpret_cast<block_array*>(ptr);
+	return access_virt(a, start_row, num_rows, writable, a->width * sizeof(JBLOCK));
+}
+
+void free_pool(j_common_ptr info, int pool_id)
+{
+	if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+		throw memory_error(JERR_BAD_POOL_ID);
+	}
+	arena_memory_mgr * mgr = manager(info);
+	if (pool_id == JPOOL_IMAGE) {
+		mgr->sarrays = nullptr;
+		mgr->barrays = nullptr;
+		mgr->store.close();
+		mgr->usage = memory_usage{};
+	}
+	mgr->arenas->pools[pool_id].reset();
+}
+
+void self_destruct(j_common_ptr info)
+{
+	arena_memory_mgr * mgr = manager(info);
+	info->mem = mgr->original;
+	if (!cache_gone) {
+		try {
+			cache.put(std::move(mgr->arenas));
+		} catch(...) {
+			//not cached, then; nothing may be thrown back into libjpeg
+		}
+	}
+	delete mgr;
+	(*info->mem->self_destruct)(info);
+}
+
+//Wraps a method for libjpeg to call. Nothing may be thrown through libjpeg's C code, so, as in libjpeg's own jmemmgr, failures go to the
+//object's error manager, whose error_exit doesn't return.
+template<auto Method>
+struct reported;
+
+template<class R, class... Args, R (*Method)(j_common_ptr, Args...)>
+struct reported<Method> {
+	static R call(j_common_ptr info, Args... args)
+	{
+		int code;
+		try {
+			return Method(info, args...);
+		} catch(memory_error const& e) {
+			code = e.code;
+		} catch(std::bad_alloc const&) {
+			code = JERR_OUT_OF_MEMORY;
+		} catch(...) {
+			code = JERR_VIRTUAL_BUG;
+		}
+		ERREXIT(info, code);
+		return R();
+	}
+};
+
+}	//namespace
+
+void use_arena_memory(j_common_ptr info)
+{
+	auto mgr = std::make_unique<arena_memory_mgr>();
+	mgr->pub.alloc_small = reported<alloc_small>::call;
+	//large objects come out of the same arenas; big ones get a block of their own anyway
+	mgr->pub.alloc_large = reported<alloc_small>::call;
+	mgr->pub.alloc_sarray = reported<alloc_sarray>::call;
+	mgr->pub.alloc_barray = reported<alloc_barray>::call;
+	mgr->pub.request_virt_sarray = reported<request_virt_sarray>::call;
+	mgr->pub.request_virt_barray = reported<request_virt_barray>::call;
+	mgr->pub.realize_virt_arrays = reported<realize_virt_arrays>::call;
+	mgr->pub.access_virt_sarray = reported<access_virt_sarray>::call;
+	mgr->pub.access_virt_barray = reported<access_virt_barray>::call;
+	mgr->pub.free_pool = reported<free_pool>::call;
+	mgr->pub.self_destruct = self_destruct;
+	mgr->pub.max_memory_to_use = static_cast<long>( memory_budget() );
+	mgr->pub.max_alloc_chunk = info->mem->max_alloc_chunk;
+	mgr->original = info->mem;
+	mgr->arenas = cache_gone ? std::make_unique<arena_set>() : cache.get();
+	mgr->sarrays = nullptr;
+	mgr->barrays = nullptr;
+	info->mem = &mgr.release()->pub;
+}
+
+void * alloc_small_throwing(j_common_ptr info, int pool_id, std::size_t size)
+{
+	return alloc_small(info, pool_id, size);
+}
+
+jvirt_barray_ptr request_virt_barray_throwing(j_common_ptr info, int pool_id, boolean pre_zero, JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+	return request_virt_barray(info, pool_id, pre_zero, blocksperrow, numrows, maxaccess);
+}
+
+void realize_virt_arrays_throwing(j_common_ptr info)
+{
+	realize_virt_arrays(info);
+}
+
+void discard_virt_arrays(j_common_ptr info)
+{
+	arena_memory_mgr * mgr = manager(info);
+	mgr->sarrays = nullptr;
+	mgr->barrays = nullptr;
+	mgr->store.close();
+	mgr->usage = memory_usage{};
+}
+
+void trim_image_memory(j_common_ptr info)
+{
+	manager(info)->arenas->pools[JPOOL_IMAGE].trim(max_retained_sz);
+}
+
+JBLOCKARRAY access_virt_barray_throwing(j_common_ptr info, jvirt_barray_ptr ptr, JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	return access_virt_barray(info, ptr, start_row, num_rows, writable);
+}
+
+memory_usage get_memory_usage(j_common_ptr info)
+{
+	return manager(info)->usage;
+}
+
+void set_memory_budget(std::size_t bytes)
+{
+	default_budget.store(bytes, std::memory_order_relaxed);
+}
+
+std::size_t memory_budget()
+{
+	return default_budget.load(std::memory_order_relaxed);
+}
+
+void set_huge_pages(bool enable)
+{
+	huge_pages.store(enable, std::memory_order_relaxed);
+}
+
+}}}	//namespace zindorsky::steganography::jpeg
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <jpeglib.h>
+
+namespace zindorsky {
+namespace steganography {
+namespace jpeg {
+
+//Replaces the memory manager of a libjpeg object, right after jpeg_create_compress/jpeg_create_decompress, with one that carves pools and
+//virtual arrays out of arenas cached by the calling thread. When the object is destroyed its arenas are reset and handed back to the
+//cache of the destroying thread instead of being freed, so a batch of carriers reuses the same (already faulted in) memory.
+void use_arena_memory(j_common_ptr info);
+
+//Memory use of the virtual arrays (which hold the coefficients) of a libjpeg object set up by use_arena_memory.
+struct memory_usage {
+	//max_memory_to_use when the arrays were realized; 0 means unlimited.
+	std::size_t budget = 0;
+	//Bytes of array data held in memory.
+	std::size_t in_memory = 0;
+	//Bytes of array data paged to a temp file because they didn't fit the budget, and traffic to and from that file so far.
+	std::size_t spilled = 0, bytes_written = 0, bytes_read = 0;
+};
+
+memory_usage get_memory_usage(j_common_ptr info);
+
+//The memory manager's methods, for C++ code working on the coefficients of objects set up by use_arena_memory outside of libjpeg.
+//Where the methods libjpeg calls report failures to the object's error manager, these throw jpeg_exception (or std::bad_alloc).
+void * alloc_small_throwing(j_common_ptr info, int pool_id, std::size_t size);
+jvirt_barray_ptr request_virt_barray_throwing(j_common_ptr info, int pool_id, boolean pre_zero, JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess);
+void realize_virt_arrays_throwing(j_common_ptr info);
+//Forgets every virtual array requested so far, so that libjpeg can start over after a failed attempt at decoding the coefficients.
+//Their memory comes back with the image pool.
+void discard_virt_arrays(j_common_ptr info);
+//Frees image memory beyond what cached arenas keep. Only call once the image pool has been freed (by jpeg_abort, say).
+void trim_image_memory(j_common_ptr info);
+JBLOCKARRAY access_virt_barray_throwing(j_common_ptr info, jvirt_barray_ptr ptr, JDIMENSION start_row, JDIMENSION num_rows, boolean writable);
+
+//Budget for the virtual arrays of libjpeg objects set up from then on, stored in their max_memory_to_use. Arrays that don't fit are paged
+//in bands to a temp file. 0 (the default) means unlimited.
+void set_memory_budget(std::size_t bytes);
+std::size_t memory_budget();
+
+//When enabled, large arena blocks (which is where coefficient arrays live) are mapped with transparent huge pages where the OS supports it.
+//Applies to blocks allocated from then on. Off by default.
+void set_huge_pages(bool enable);
+
+}}}	//namespace zindorsky::steganography::jpeg
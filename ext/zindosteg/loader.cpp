@@ -1,9 +1,15 @@
+#include <algorithm>
 #include <fstream>
 #include "provider.h"
+#include "mapped_file.h"
+#include "decoded_cache.h"
+#include "provider_cache.h"
 //Currently implemented providers:
 #include "bmp.h"
 #include "jpeg.h"
 #include "png_provider.h"
+#include "wav.h"
+#include "y4m.h"
 #include "string.h"
 
 namespace zindorsky {
@@ -11,29 +17,95 @@ namespace steganography {
 
 namespace {
 	const size_t min_header_sz = 0x40;
+
+	enum class carrier_format { unknown, bmp, jpeg, png, wav, y4m };
+
+	carrier_format sniff(byte const* header)
+	{
+		if( header[0]=='B' && header[1]=='M' ) {
+			return carrier_format::bmp;
+		}
+		if( header[0]==0xff && header[1]==0xd8 && header[2]==0xff
+			&& (memcmp(&header[6],"JFIF",4)==0 || memcmp(&header[6],"Exif",4)==0) )
+		{
+			return carrier_format::jpeg;
+		}
+		if( memcmp(header, png_provider::signature, sizeof(png_provider::signature)) == 0 ) {
+			return carrier_format::png;
+		}
+		if( memcmp(header,"RIFF",4)==0 && memcmp(&header[8],"WAVE",4)==0 ) {
+			return carrier_format::wav;
+		}
+		if( memcmp(header,"YUV4MPEG2 ",10)==0 ) {
+			return carrier_format::y4m;
+		}
+		return carrier_format::unknown;
+	}
+
+	template<class Provider>
+	std::unique_ptr<provider_t> decode(byte const* data, size_t size, std::shared_ptr<utils::shared_mapping> const&)
+	{
+		return std::make_unique<Provider>(data, size);
+	}
+
+	//JPEG carriers with restart intervals keep their encoded bytes: the mapping, when they lie in one.
+	template<>
+	std::unique_ptr<provider_t> decode<jpeg_provider>(byte const* data, size_t size, std::shared_ptr<utils::shared_mapping> const& file)
+	{
+		return file ? std::make_unique<jpeg_provider>(file) : std::make_unique<jpeg_provider>(data, size);
+	}
+
+	bool caching()
+	{
+		return !decoded_cache::directory().empty();
+	}
+
+	//Decoded carriers loaded from files are shared through the in-process cache when it's on, and come from the on-disk one when that's on.
+	template<class Provider>
+	std::unique_ptr<provider_t> load_decoded(utils::mapped_file && mapping)
+	{
+		auto carrier = utils::shared_mapping::make(std::move(mapping));
+		if (provider_cache::limit() > 0) {
+			return provider_cache::load(carrier, [](byte const*, size_t, std::shared_ptr<utils::shared_mapping> const& file) {
+				return decoded_cache::load(file, decode<Provider>);
+			});
+		}
+		return decoded_cache::load(carrier, decode<Provider>);
+	}
+
+	//Files past the paging threshold are paged in under a fixed budget rather than mapped, so changing them never takes more memory.
+	template<class Mapped, class Paged>
+	std::unique_ptr<provider_t> load_uncompressed(filesystem::path const& file, std::uintmax_t size)
+	{
+		if (size > paged_provider::paging_threshold()) {
+			return std::make_unique<Paged>( file );
+		}
+		return std::make_unique<Mapped>( utils::mapped_file(file) );
+	}
 }
 
 std::unique_ptr<provider_t> provider_t::load(filesystem::path const& file)
 {
-	std::ifstream source(file.c_str());
-	//read first few bytes for header
+	//The format comes from a read of the header and the size from the file system, so carriers that are paged are never mapped (nor,
+	//without mmap, read whole). The others are mapped once: BMP and WAV keep the mapping for their samples; JPEG and PNG decode straight
+	//out of it. Y4M is always paged.
+	std::uintmax_t size = filesystem::file_size(file);
 	byte header[min_header_sz];
-	source.read(reinterpret_cast<char*>(header),sizeof(header));
-	source.close();
-	
-	if( header[0]=='B' && header[1]=='M' ) {
-		return std::make_unique<bmp_provider>( file );
-	}
-	if( header[0]==0xff && header[1]==0xd8 && header[2]==0xff
-		&& (memcmp(&header[6],"JFIF",4)==0 || memcmp(&header[6],"Exif",4)==0) )
 	{
-		return std::make_unique<jpeg_provider>( file );
+		std::ifstream source(file.c_str(), std::ios::binary);
+		if( size < min_header_sz || !source.read(reinterpret_cast<char*>(header),sizeof(header)) ) {
+			throw invalid_carrier{};
+		}
 	}
-    if( memcmp(header, png_provider::signature, sizeof(png_provider::signature)) == 0 ) {
-        return std::make_unique<png_provider>(file);
-    }
 
-	throw invalid_carrier{};
+	switch( sniff(header) ) {
+	case carrier_format::bmp: return load_uncompressed<bmp_provider, paged_bmp_provider>( file, size );
+	case carrier_format::jpeg: return load_decoded<jpeg_provider>( utils::mapped_file(file) );
+	case carrier_format::png: return load_decoded<png_provider>( utils::mapped_file(file) );
+	case carrier_format::wav: return load_uncompressed<wav_provider, paged_wav_provider>( file, size );
+	case carrier_format::y4m: return std::make_unique<y4m_provider>( file );
+	default: throw invalid_carrier{};
+	}
 }
 
 std::unique_ptr<provider_t> provider_t::load(void const* data, size_t size)
@@ -44,19 +116,96 @@ std::unique_ptr<provider_t> provider_t::load(void const* data, size_t size)
 		throw invalid_carrier{};
 	}
 
-	if( d[0]=='B' && d[1]=='M' ) {
-		return std::make_unique<bmp_provider>( d, size );
+	switch( sniff(d) ) {
+	case carrier_format::bmp: return std::make_unique<bmp_provider>( d, size );
+	case carrier_format::jpeg: return decoded_cache::load( d, size, decode<jpeg_provider> );
+	case carrier_format::png: return decoded_cache::load( d, size, decode<png_provider> );
+	case carrier_format::wav: return std::make_unique<wav_provider>( d, size );
+	case carrier_format::y4m: return std::make_unique<y4m_provider>( d, size );
+	default: throw invalid_carrier{};
+	}
+}
+
+std::unique_ptr<provider_t> provider_t::load(byte_vector && data)
+{
+	if (data.size() < min_header_sz) {
+		throw invalid_carrier{};
+	}
+
+	switch( sniff(data.data()) ) {
+	case carrier_format::bmp: return std::make_unique<bmp_provider>( std::move(data) );
+	case carrier_format::jpeg: return caching() ? decoded_cache::load( std::move(data), decode<jpeg_provider> ) : std::make_unique<jpeg_provider>( std::move(data) );
+	case carrier_format::png: return caching() ? decoded_cache::load( std::move(data), decode<png_provider> ) : std::make_unique<png_provider>( std::move(data) );
+	case carrier_format::wav: return std::make_unique<wav_provider>( std::move(data) );
+	case carrier_format::y4m: return std::make_unique<y4m_provider>( std::move(data) );
+	default: throw invalid_carrier{};
 	}
-	if( d[0]==0xff && d[1]==0xd8 && d[2]==0xff
-		&& (memcmp(&d[6],"JFIF",4)==0 || memcmp(&d[6],"Exif",4)==0) )
+}
+
+std::unique_ptr<provider_t> provider_t::load(byte_span data)
+{
+	if (!data.data() || data.size() < min_header_sz) {
+		throw invalid_carrier{};
+	}
+
+	switch( sniff(data.data()) ) {
+	case carrier_format::bmp: return std::make_unique<bmp_provider>( data );
+	case carrier_format::jpeg: return decoded_cache::load( data.data(), data.size(), decode<jpeg_provider> );
+	case carrier_format::png: return decoded_cache::load( data.data(), data.size(), decode<png_provider> );
+	case carrier_format::wav: return std::make_unique<wav_provider>( data );
+	case carrier_format::y4m: return std::make_unique<y4m_provider>( data.data(), data.size() );
+	default: throw invalid_carrier{};
+	}
+}
+
+namespace {
+	provider_t::carrier_info probe_headers(byte const* header, provider_t::header_reader const& read)
 	{
-		return std::make_unique<jpeg_provider>( d, size );
+		switch( sniff(header) ) {
+		case carrier_format::bmp: return bmp_provider::probe( read );
+		case carrier_format::jpeg: return jpeg_provider::probe( read );
+		case carrier_format::png: return png_provider::probe( read );
+		case carrier_format::wav: return wav_provider::probe( read );
+		case carrier_format::y4m: return y4m_provider::probe( read );
+		default: throw invalid_carrier{};
+		}
+	}
+}
+
+provider_t::carrier_info provider_t::probe(filesystem::path const& file)
+{
+	std::ifstream source(file.c_str(), std::ios::binary);
+	byte header[min_header_sz];
+	if( !source.read(reinterpret_cast<char*>(header),sizeof(header)) ) {
+		throw invalid_carrier{};
+	}
+
+	return probe_headers(header, [&source](size_t offset, byte * out, size_t size) -> size_t {
+		source.clear();
+		if( !source.seekg(offset) ) {
+			return 0;
+		}
+		source.read(reinterpret_cast<char*>(out), size);
+		return static_cast<size_t>(source.gcount());
+	});
+}
+
+provider_t::carrier_info provider_t::probe(void const* data, size_t size)
+{
+	byte const* d = static_cast<byte const*>(data);
+
+	if (!d || size < min_header_sz) {
+		throw invalid_carrier{};
 	}
-    if( memcmp(data, png_provider::signature, sizeof(png_provider::signature))==0 ) {
-        return std::make_unique<png_provider>(d, size);
-    }
 
-	throw invalid_carrier{};
+	return probe_headers(d, [d, size](size_t offset, byte * out, size_t n) -> size_t {
+		if (offset >= size) {
+			return 0;
+		}
+		n = std::min(n, size - offset);
+		memcpy(out, d + offset, n);
+		return n;
+	});
 }
 
 std::vector<std::string> provider_t::supported_formats()
@@ -65,6 +214,8 @@ std::vector<std::string> provider_t::supported_formats()
 		bmp_provider::format()
 		, jpeg_provider::format()
 		, png_provider::format()
+		, wav_provider::format()
+		, y4m_provider::format()
 	};
 }
 
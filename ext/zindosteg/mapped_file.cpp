@@ -0,0 +1,272 @@
+#include "mapped_file.h"
+#include "file_utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <system_error>
+#include <utility>
+#if defined(__unix__) || defined(__APPLE__)
+# define HAVE_MMAP 1
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+namespace zindorsky {
+namespace steganography {
+namespace utils {
+
+mapped_file::mapped_file(filesystem::path const& path, mode m)
+	: path_(path)
+	, mode_(m)
+{
+#if defined(HAVE_MMAP)
+	int fd = ::open(path.c_str(), m == mode::shared ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), path.string());
+	}
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+		int err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category(), path.string());
+	}
+	size_ = static_cast<std::size_t>(st.st_size);
+	identity_.device = static_cast<std::uint64_t>(st.st_dev);
+	identity_.inode = static_cast<std::uint64_t>(st.st_ino);
+	identity_.size = static_cast<std::uint64_t>(st.st_size);
+#if defined(__APPLE__)
+	identity_.modified = static_cast<std::int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	identity_.modified = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	if (size_ > 0) {
+		//Private mappings of a read-only descriptor can still be written to; the changes just never reach the file.
+		void * p = ::mmap(nullptr, size_, PROT_READ|PROT_WRITE, m == mode::shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::generic_category(), path.string());
+		}
+		data_ = static_cast<byte*>(p);
+	}
+	//The mapping keeps the file open.
+	::close(fd);
+#else
+	fallback_ = load_from_file(path);
+	data_ = fallback_.data();
+	size_ = fallback_.size();
+	identity_.size = size_;
+	std::error_code ec;
+	identity_.modified = static_cast<std::int64_t>( filesystem::last_write_time(path, ec).time_since_epoch().count() );
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+	release();
+}
+
+mapped_file::mapped_file(mapped_file && other) noexcept
+{
+	*this = std::move(other);
+}
+
+mapped_file & mapped_file::operator = (mapped_file && other) noexcept
+{
+	if (this != &other) {
+		release();
+		path_ = std::move(other.path_);
+		mode_ = other.mode_;
+		identity_ = other.identity_;
+		fallback_ = std::move(other.fallback_);
+		data_ = fallback_.empty() ? other.data_ : fallback_.data();
+		size_ = other.size_;
+		other.data_ = nullptr;
+		other.size_ = 0;
+	}
+	return *this;
+}
+
+void mapped_file::release()
+{
+#if defined(HAVE_MMAP)
+	if (data_ && fallback_.empty()) {
+		::munmap(data_, size_);
+	}
+#endif
+	data_ = nullptr;
+	size_ = 0;
+	fallback_.clear();
+}
+
+void mapped_file::advise_random()
+{
+#if defined(HAVE_MMAP) && defined(MADV_RANDOM)
+	if (data_) {
+		::madvise(data_, size_, MADV_RANDOM);
+	}
+#endif
+}
+
+void mapped_file::sync()
+{
+#if defined(HAVE_MMAP)
+	if (data_ && mode_ == mode::shared && ::msync(data_, size_, MS_SYNC) != 0) {
+		throw std::system_error(errno, std::generic_category(), path_.string());
+	}
+#else
+	if (mode_ == mode::shared) {
+		save_to_file(path_, fallback_);
+	}
+#endif
+}
+
+void mapped_file::write_back(std::vector<std::pair<std::size_t, std::size_t>> const& ranges, bool durable)
+{
+	if (ranges.empty() && !durable) {
+		return;
+	}
+#if defined(HAVE_MMAP)
+	int fd = ::open(path_.c_str(), O_WRONLY);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), path_.string());
+	}
+	int err = 0;
+	for (auto const& r : ranges) {
+		byte const* p = data_ + r.first;
+		std::size_t left = r.second;
+		off_t offset = static_cast<off_t>(r.first);
+		while (left > 0 && !err) {
+			ssize_t n = ::pwrite(fd, p, left, offset);
+			if (n < 0) {
+				if (errno != EINTR) {
+					err = errno;
+				}
+				continue;
+			}
+			p += n;
+			offset += n;
+			left -= static_cast<std::size_t>(n);
+		}
+	}
+	if (!err && durable && ::fdatasync(fd) != 0) {
+		err = errno;
+	}
+	::close(fd);
+	if (err) {
+		throw std::system_error(err, std::generic_category(), path_.string());
+	}
+#else
+	std::fstream f(path_.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+	for (auto const& r : ranges) {
+		f.seekp(static_cast<std::streamoff>(r.first));
+		f.write(reinterpret_cast<char const*>(data_ + r.first), static_cast<std::streamsize>(r.second));
+	}
+	f.flush();
+#endif
+}
+
+namespace {
+	//Live shared mappings, found by their file's device and inode. Expired ones are pruned as the list is walked.
+	std::mutex shared_mappings_mutex;
+	std::vector<std::weak_ptr<shared_mapping>> shared_mappings;
+}
+
+shared_mapping::shared_mapping(mapped_file && file)
+	: file_(std::move(file))
+	, path_(file_.path())
+	, identity_(file_.identity())
+{
+}
+
+std::shared_ptr<shared_mapping> shared_mapping::make(mapped_file && file)
+{
+	auto mapping = std::make_shared<shared_mapping>(std::move(file));
+	//Without a device and inode there's nothing to recognize the file by; nor, without mmap, anything to detach.
+	if (mapping->identity_.device || mapping->identity_.inode) {
+		std::lock_guard<std::mutex> lock(shared_mappings_mutex);
+		shared_mappings.erase(std::remove_if(shared_mappings.begin(), shared_mappings.end(), [](std::weak_ptr<shared_mapping> const& m) {
+			return m.expired();
+		}), shared_mappings.end());
+		shared_mappings.push_back(mapping);
+	}
+	return mapping;
+}
+
+byte_span shared_mapping::bytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (file_.data()) {
+		return byte_span(file_.data(), file_.size());
+	}
+	return byte_span(const_cast<byte*>(copy_.data()), copy_.size());
+}
+
+std::size_t shared_mapping::memory_footprint() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return copy_.size();
+}
+
+void shared_mapping::detach()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (file_.data()) {
+		copy_.assign(file_.data(), file_.data() + file_.size());
+		file_ = mapped_file();
+	}
+}
+
+void detach_shared_mappings(filesystem::path const& file)
+{
+#if defined(HAVE_MMAP)
+	struct stat st;
+	if (::stat(file.c_str(), &st) != 0) {
+		return;
+	}
+	std::vector<std::shared_ptr<shared_mapping>> found;
+	{
+		std::lock_guard<std::mutex> lock(shared_mappings_mutex);
+		for (auto const& m : shared_mappings) {
+			auto mapping = m.lock();
+			if (mapping && mapping->identity().device == static_cast<std::uint64_t>(st.st_dev) && mapping->identity().inode == static_cast<std::uint64_t>(st.st_ino)) {
+				found.push_back(std::move(mapping));
+			}
+		}
+	}
+	//Copied without holding the list's lock; the last reference to one of them may also go here, which takes no lock of the list's.
+	for (auto & mapping : found) {
+		mapping->detach();
+	}
+#else
+	(void)file;
+#endif
+}
+
+dirty_blocks::dirty_blocks(std::size_t file_size, std::size_t block_size)
+	: bits_((file_size + block_size - 1) / block_size, false)
+	, block_sz_(block_size)
+	, file_sz_(file_size)
+{
+}
+
+std::vector<std::pair<std::size_t, std::size_t>> dirty_blocks::ranges() const
+{
+	std::vector<std::pair<std::size_t, std::size_t>> result;
+	for (std::size_t b = 0; b < bits_.size(); ++b) {
+		if (!bits_[b]) {
+			continue;
+		}
+		std::size_t offset = b * block_sz_, length = std::min(block_sz_, file_sz_ - offset);
+		if (!result.empty() && result.back().first + result.back().second == offset) {
+			result.back().second += length;
+		} else {
+			result.emplace_back(offset, length);
+		}
+	}
+	return result;
+}
+
+}}}	//namespace zindorsky::steganography::utils
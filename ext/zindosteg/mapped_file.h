@@ -0,0 +1,120 @@
+#pragma once
+
+#include "steg_defs.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+namespace utils {
+
+//A whole file mapped into memory, so that opening it costs nothing and only the pages actually touched are read from disk.
+//Meant for uncompressed carriers, where the pixels can be used right where they lie in the file.
+//Where memory mapping isn't available the file is simply read into memory.
+class mapped_file {
+public:
+	enum class mode {
+		private_copy,	//changes stay in memory (copy on write) until written out
+		shared,			//changes go straight to the file
+	};
+
+	//The file that was mapped, as it was then: its device and inode (0 where those aren't available), size and modification time.
+	struct file_identity {
+		std::uint64_t device = 0, inode = 0, size = 0;
+		std::int64_t modified = 0;
+	};
+
+	mapped_file() = default;
+	explicit mapped_file(filesystem::path const& path, mode m = mode::private_copy);
+	~mapped_file();
+
+	//Non-copyable
+	mapped_file(mapped_file const&) = delete;
+	mapped_file & operator = (mapped_file const&) = delete;
+	//Movable
+	mapped_file(mapped_file && other) noexcept;
+	mapped_file & operator = (mapped_file && other) noexcept;
+
+	byte * data() const { return data_; }
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	filesystem::path const& path() const { return path_; }
+	mode get_mode() const { return mode_; }
+	file_identity const& identity() const { return identity_; }
+
+	//Tells the OS that access will be scattered, so faults don't read ahead.
+	void advise_random();
+	//Flushes changes in a shared mapping to the file.
+	void sync();
+	//Writes the given [offset, offset+length) ranges of a private mapping back to the file in place, optionally waiting until they're on disk.
+	void write_back(std::vector<std::pair<std::size_t, std::size_t>> const& ranges, bool durable);
+
+private:
+	filesystem::path path_;
+	mode mode_ = mode::private_copy;
+	file_identity identity_;
+	byte * data_ = nullptr;
+	std::size_t size_ = 0;
+	//Holds the file when it couldn't be mapped.
+	byte_vector fallback_;
+
+	void release();
+};
+
+//A private mapping of an encoded carrier, shared by whatever keeps the encoded bytes around instead of copying them (JPEG carriers with
+//restart intervals, the caches). Writing a file in place changes what its private mappings show, so anything that overwrites a carrier
+//calls detach_shared_mappings() first, which copies the bytes of every live shared mapping of that file into memory.
+class shared_mapping {
+public:
+	explicit shared_mapping(mapped_file && file);
+
+	//Non-copyable
+	shared_mapping(shared_mapping const&) = delete;
+	shared_mapping & operator = (shared_mapping const&) = delete;
+
+	//Registers the mapping, so that detach_shared_mappings() finds it.
+	static std::shared_ptr<shared_mapping> make(mapped_file && file);
+
+	//Until the mapping is detached, the mapped bytes; then the copy. Don't hold on to the span across a write to the file.
+	byte_span bytes() const;
+	filesystem::path const& path() const { return path_; }
+	mapped_file::file_identity const& identity() const { return identity_; }
+	//Bytes of memory held: none while mapped, the whole file once detached.
+	std::size_t memory_footprint() const;
+
+	void detach();
+
+private:
+	mutable std::mutex mutex_;
+	mapped_file file_;
+	byte_vector copy_;
+	filesystem::path path_;
+	mapped_file::file_identity identity_;
+};
+
+//Copies the bytes of every live shared_mapping of "file" (if it exists) into memory. Call before writing over a file in place.
+void detach_shared_mappings(filesystem::path const& file);
+
+//Which blocks of a file (or of any other run of offsets) were written to, one bit each however often they're written. Used for
+//mapped_file::write_back.
+class dirty_blocks {
+public:
+	static const std::size_t default_block_sz = 512;
+
+	explicit dirty_blocks(std::size_t file_size = 0, std::size_t block_size = default_block_sz);
+
+	void mark(std::size_t offset) { bits_[offset / block_sz_] = true; }
+	void clear() { bits_.assign(bits_.size(), false); }
+	//Runs of dirty blocks as [offset, offset+length) ranges, the last one ending at the end of the file.
+	std::vector<std::pair<std::size_t, std::size_t>> ranges() const;
+	std::size_t memory_footprint() const { return bits_.capacity() / 8; }
+
+private:
+	std::vector<bool> bits_;
+	std::size_t block_sz_, file_sz_;
+};
+
+}}}	//namespace zindorsky::steganography::utils
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "steg_defs.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace zindorsky {
+namespace steganography {
+
+//Destination of an in-memory commit. Encoders write straight into the sink's buffer, so the carrier is copied at most once on its way to the caller.
+class memory_sink {
+public:
+	virtual ~memory_sink() {}
+
+	//Returns a buffer of at least "size" bytes. Bytes written by earlier calls are kept, but the buffer may move.
+	virtual byte * reserve(std::size_t size) = 0;
+	//The output is complete and is the first "size" bytes of the buffer.
+	virtual void commit(std::size_t size) = 0;
+	//The output is complete and is exactly "data". Sinks that can take over the allocation should override this.
+	virtual void adopt(byte_vector && data)
+	{
+		if (!data.empty()) {
+			std::memcpy(reserve(data.size()), data.data(), data.size());
+		}
+		commit(data.size());
+	}
+};
+
+//Commits into a byte_vector, taking over encoder buffers where it can.
+class vector_sink : public memory_sink {
+public:
+	virtual byte * reserve(std::size_t size) override
+	{
+		if (data_.size() < size) {
+			data_.resize(size);
+		}
+		return data_.data();
+	}
+
+	virtual void commit(std::size_t size) override { data_.resize(size); }
+	virtual void adopt(byte_vector && data) override { data_ = std::move(data); }
+
+	byte_vector release() { return std::move(data_); }
+
+private:
+	byte_vector data_;
+};
+
+//Lets encoders that produce output piecemeal append to a sink, growing its buffer geometrically from an initial size estimate.
+class sink_writer {
+public:
+	sink_writer(memory_sink & sink, std::size_t size_hint)
+		: sink_(sink)
+		, buffer_(sink.reserve(size_hint ? size_hint : 0x1000))
+		, capacity_(size_hint ? size_hint : 0x1000)
+	{
+	}
+
+	//Makes room for at least "size" more bytes and returns where they go.
+	byte * room(std::size_t size)
+	{
+		if (capacity_ - used_ < size) {
+			capacity_ = std::max(capacity_ * 2, used_ + size);
+			buffer_ = sink_.reserve(capacity_);
+		}
+		return buffer_ + used_;
+	}
+
+	//Marks "size" bytes at room() as written.
+	void advance(std::size_t size) { used_ += size; }
+
+	void write(byte const* data, std::size_t size)
+	{
+		std::memcpy(room(size), data, size);
+		used_ += size;
+	}
+
+	std::size_t capacity() const { return capacity_; }
+	std::size_t used() const { return used_; }
+
+	void finish() { sink_.commit(used_); }
+
+private:
+	memory_sink & sink_;
+	byte * buffer_;
+	std::size_t capacity_, used_ = 0;
+};
+
+}}	//namespace zindorsky::steganography
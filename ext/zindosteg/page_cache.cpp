@@ -0,0 +1,212 @@
+#include "page_cache.h"
+#include "file_utils.h"
+#include <algorithm>
+#include <cstring>
+#include <ios>
+#if defined(_WIN32)
+# include <io.h>
+#elif defined(__unix__) || defined(__APPLE__)
+# include <unistd.h>
+#endif
+
+namespace zindorsky {
+namespace steganography {
+namespace utils {
+
+page_cache::page_cache(filesystem::path const& path, std::size_t budget)
+	: path_(path)
+	, paged_(true)
+	, source_(path.c_str(), std::ios::binary | std::ios::in)
+{
+	if (!source_) {
+		throw std::ios_base::failure("can't open " + path.string());
+	}
+	//Pages are read whole, so the stream's own buffer would only add a copy.
+	source_.rdbuf()->pubsetbuf(nullptr, 0);
+	size_ = static_cast<std::uint64_t>(filesystem::file_size(path));
+
+	std::size_t pages = static_cast<std::size_t>((size_ + page_size - 1) / page_size);
+	std::size_t slot_count = std::min(pages, std::max<std::size_t>(1, budget / page_size));
+	pool_.resize(slot_count * page_size);
+	slots_.assign(slot_count, slot{none, false, false});
+	page_slot_.assign(pages, none);
+	in_scratch_.assign(pages, false);
+}
+
+page_cache::page_cache(byte_vector && data)
+	: size_(data.size())
+	, memory_(std::move(data))
+{
+}
+
+std::size_t page_cache::page_bytes(std::size_t page) const
+{
+	return static_cast<std::size_t>(std::min<std::uint64_t>(page_size, size_ - std::uint64_t(page) * page_size));
+}
+
+std::uint32_t page_cache::load(std::size_t page)
+{
+	//clock: skip (and clear) slots referenced since the hand last passed them
+	std::uint32_t s;
+	for(;;) {
+		s = static_cast<std::uint32_t>(hand_);
+		hand_ = (hand_ + 1) % slots_.size();
+		if (slots_[s].page == none || !slots_[s].referenced) {
+			break;
+		}
+		slots_[s].referenced = false;
+	}
+
+	slot & sl = slots_[s];
+	byte * data = &pool_[s * page_size];
+	if (sl.page != none) {
+		if (sl.dirty) {
+			if (!scratch_) {
+				scratch_.reset(std::tmpfile());
+				if (!scratch_) {
+					throw std::ios_base::failure("can't create page cache scratch file");
+				}
+			}
+			std::size_t n = page_bytes(sl.page);
+			if (!seek_file(scratch_.get(), std::uint64_t(sl.page) * page_size)
+				|| std::fwrite(data, 1, n, scratch_.get()) != n)
+			{
+				throw std::ios_base::failure("page cache scratch file write fail");
+			}
+			in_scratch_[sl.page] = true;
+		}
+		page_slot_[sl.page] = none;
+	}
+
+	std::uint64_t offset = std::uint64_t(page) * page_size;
+	if (in_scratch_[page]) {
+		read_scratch(offset, data, page_bytes(page));
+	} else {
+		read_source(offset, data, page_bytes(page));
+	}
+	sl.page = static_cast<std::uint32_t>(page);
+	sl.dirty = false;
+	sl.referenced = false;
+	page_slot_[page] = s;
+	return s;
+}
+
+void page_cache::read_source(std::uint64_t offset, byte * out, std::size_t size)
+{
+	source_.clear();
+	if (!source_.seekg(static_cast<std::streamoff>(offset)) || !source_.read(reinterpret_cast<char*>(out), static_cast<std::streamsize>(size))) {
+		throw std::ios_base::failure("page cache read fail: " + path_.string());
+	}
+}
+
+void page_cache::read_scratch(std::uint64_t offset, byte * out, std::size_t size)
+{
+	if (!seek_file(scratch_.get(), offset) || std::fread(out, 1, size, scratch_.get()) != size) {
+		throw std::ios_base::failure("page cache scratch file read fail");
+	}
+}
+
+std::size_t page_cache::read(std::uint64_t offset, byte * out, std::size_t size)
+{
+	if (offset >= size_) {
+		return 0;
+	}
+	size = static_cast<std::size_t>(std::min<std::uint64_t>(size, size_ - offset));
+	if (!paged_) {
+		std::memcpy(out, &memory_[static_cast<std::size_t>(offset)], size);
+		return size;
+	}
+
+	for(std::size_t done = 0; done < size; ) {
+		std::uint64_t pos = offset + done;
+		std::size_t page = static_cast<std::size_t>(pos / page_size), in_page = static_cast<std::size_t>(pos % page_size);
+		std::size_t n = std::min(size - done, page_size - in_page);
+		if (page_slot_[page] != none) {
+			std::memcpy(out + done, &pool_[page_slot_[page] * page_size + in_page], n);
+		} else if (in_scratch_[page]) {
+			read_scratch(pos, out + done, n);
+		} else {
+			read_source(pos, out + done, n);
+		}
+		done += n;
+	}
+	return size;
+}
+
+void page_cache::write_back(bool durable)
+{
+	if (!paged_) {
+		return;
+	}
+	std::unique_ptr<std::FILE, file_closer> f;
+	auto open = [&] {
+		f.reset(std::fopen(path_.c_str(), "r+b"));
+		if (!f) {
+			throw std::ios_base::failure("can't open " + path_.string());
+		}
+	};
+	byte_vector buffer;
+	//in file order, so the writes are sequential
+	for(std::size_t page = 0; page < page_slot_.size(); ++page) {
+		std::uint32_t s = page_slot_[page];
+		bool resident_change = s != none && (slots_[s].dirty || in_scratch_[page]);
+		if (!resident_change && !in_scratch_[page]) {
+			continue;
+		}
+		if (!f) {
+			open();
+		}
+		std::size_t n = page_bytes(page);
+		byte const* data;
+		if (resident_change) {
+			data = &pool_[s * page_size];
+			slots_[s].dirty = false;
+		} else {
+			buffer.resize(n);
+			read_scratch(std::uint64_t(page) * page_size, buffer.data(), n);
+			data = buffer.data();
+		}
+		if (!seek_file(f.get(), std::uint64_t(page) * page_size) || std::fwrite(data, 1, n, f.get()) != n) {
+			throw std::ios_base::failure("page cache write back fail: " + path_.string());
+		}
+		in_scratch_[page] = false;
+	}
+
+	//Even with nothing to write, durable makes sure earlier write backs are on disk.
+	if (!f && durable) {
+		open();
+	}
+	if (f) {
+		bool ok = std::fflush(f.get()) == 0;
+#if defined(_WIN32)
+		ok = ok && (!durable || ::_commit(::_fileno(f.get())) == 0);
+#elif defined(__unix__) || defined(__APPLE__)
+		ok = ok && (!durable || ::fsync(::fileno(f.get())) == 0);
+#endif
+		//Buffered writes can still fail as the file is closed.
+		ok = std::fclose(f.release()) == 0 && ok;
+		if (!ok) {
+			throw std::ios_base::failure("page cache write back fail: " + path_.string());
+		}
+	}
+}
+
+void page_cache::save_to(filesystem::path const& path)
+{
+	if (!paged_) {
+		save_to_file(path, memory_);
+		return;
+	}
+	std::ofstream f(path.c_str(), std::ios::binary | std::ios::out);
+	byte_vector buffer(std::min<std::uint64_t>(size_, std::uint64_t(1) << 20));
+	for(std::uint64_t offset = 0; offset < size_; offset += buffer.size()) {
+		std::size_t n = read(offset, buffer.data(), buffer.size());
+		f.write(reinterpret_cast<char const*>(buffer.data()), n);
+	}
+	f.close();
+	if (!f) {
+		throw std::ios_base::failure("can't write " + path.string());
+	}
+}
+
+}}}	//namespace zindorsky::steganography::utils
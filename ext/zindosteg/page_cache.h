@@ -0,0 +1,98 @@
+#pragma once
+
+#include "steg_defs.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+namespace utils {
+
+//A fixed number of pages of a file held in memory, for carriers far too big to load (or to keep dirty in a mapping). Pages are evicted by
+//the clock algorithm; evicted pages that were written to go to a temp file, so changes never reach the file until they're written back.
+//Memory use is bounded by the budget however big the file and however many pages are changed.
+class page_cache {
+public:
+	static const std::size_t page_size = std::size_t(16) << 10;
+	static const std::size_t default_budget = std::size_t(64) << 20;
+
+	page_cache() = default;
+	explicit page_cache(filesystem::path const& path, std::size_t budget = default_budget);
+	//Holds all of "data" in memory instead; nothing is paged.
+	explicit page_cache(byte_vector && data);
+
+	//Non-copyable
+	page_cache(page_cache const&) = delete;
+	page_cache & operator = (page_cache const&) = delete;
+	//Movable
+	page_cache(page_cache &&) = default;
+	page_cache & operator = (page_cache &&) = default;
+
+	std::uint64_t size() const { return size_; }
+	//Empty when not backed by a file.
+	filesystem::path const& path() const { return path_; }
+	//The pages held in memory (or the whole file, when not paged).
+	std::size_t memory_footprint() const { return paged_ ? pool_.size() : memory_.size(); }
+
+	//The byte at "offset", after making its page resident. The reference is only good until the next call.
+	byte & at(std::uint64_t offset, bool writable)
+	{
+		if (!paged_) {
+			return memory_[static_cast<std::size_t>(offset)];
+		}
+		std::size_t page = static_cast<std::size_t>(offset / page_size);
+		std::uint32_t s = page_slot_[page];
+		if (s == none) {
+			s = load(page);
+		}
+		slot & sl = slots_[s];
+		sl.referenced = true;
+		sl.dirty = sl.dirty || writable;
+		return pool_[s * page_size + static_cast<std::size_t>(offset % page_size)];
+	}
+
+	//Copies bytes as modified so far into "out", without caching the pages they come from. Returns how many were in the file.
+	std::size_t read(std::uint64_t offset, byte * out, std::size_t size);
+	//Writes the changed pages into the file itself, in place, optionally waiting until they're on disk.
+	void write_back(bool durable);
+	//Writes the whole file, as modified, to "path" (which must be a different file).
+	void save_to(filesystem::path const& path);
+
+private:
+	static constexpr std::uint32_t none = ~std::uint32_t(0);
+
+	struct slot {
+		std::uint32_t page;
+		bool dirty, referenced;
+	};
+
+	struct file_closer {
+		void operator () (std::FILE * f) const { std::fclose(f); }
+	};
+
+	filesystem::path path_;
+	bool paged_ = false;
+	std::uint64_t size_ = 0;
+	//The whole file when not paged.
+	byte_vector memory_;
+
+	std::ifstream source_;
+	//Changed pages that were evicted, each at its offset in the file.
+	std::unique_ptr<std::FILE, file_closer> scratch_;
+	byte_vector pool_;
+	std::vector<slot> slots_;
+	std::size_t hand_ = 0;
+	//Slot holding each page, or none, and whether the page's current contents are in the scratch file.
+	std::vector<std::uint32_t> page_slot_;
+	std::vector<bool> in_scratch_;
+
+	std::size_t page_bytes(std::size_t page) const;
+	std::uint32_t load(std::size_t page);
+	void read_source(std::uint64_t offset, byte * out, std::size_t size);
+	void read_scratch(std::uint64_t offset, byte * out, std::size_t size);
+};
+
+}}}	//namespace zindorsky::steganography::utils
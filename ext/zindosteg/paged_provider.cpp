@@ -0,0 +1,81 @@
+#include "paged_provider.h"
+#include <atomic>
+
+namespace zindorsky {
+namespace steganography {
+
+namespace {
+	std::atomic<std::size_t> budget{utils::page_cache::default_budget};
+	std::atomic<std::uint64_t> threshold{std::uint64_t(1) << 30};
+}
+
+void paged_provider::set_memory_budget(std::size_t bytes)
+{
+	budget.store(bytes, std::memory_order_relaxed);
+}
+
+std::size_t paged_provider::memory_budget()
+{
+	return budget.load(std::memory_order_relaxed);
+}
+
+void paged_provider::set_paging_threshold(std::uint64_t bytes)
+{
+	threshold.store(bytes, std::memory_order_relaxed);
+}
+
+std::uint64_t paged_provider::paging_threshold()
+{
+	return threshold.load(std::memory_order_relaxed);
+}
+
+paged_provider::paged_provider(filesystem::path const& filename, std::size_t budget)
+	: file_(filename, budget)
+{
+}
+
+paged_provider::paged_provider(byte_vector && data)
+	: file_(std::move(data))
+{
+}
+
+byte & paged_provider::access_indexed_data( index_t index )
+{
+	return file_.at(logical_to_physical(index), true);
+}
+
+byte const& paged_provider::access_indexed_data( index_t index ) const
+{
+	return file_.at(logical_to_physical(index), false);
+}
+
+void paged_provider::commit_to_memory(memory_sink & sink)
+{
+	std::size_t size = static_cast<std::size_t>(file_.size());
+	sink.commit(file_.read(0, sink.reserve(size), size));
+}
+
+void paged_provider::commit_to_file(filesystem::path const& file)
+{
+	std::error_code ec;
+	if (!file_.path().empty() && filesystem::equivalent(file, file_.path(), ec)) {
+		//Only the changed pages are written, in place.
+		file_.write_back(options_.durable);
+		return;
+	}
+	file_.save_to(file);
+}
+
+std::size_t paged_provider::memory_footprint() const
+{
+	return file_.memory_footprint();
+}
+
+provider_t::header_reader paged_provider::reader() const
+{
+	return [this](size_t offset, byte * out, size_t size) -> size_t {
+		return file_.read(offset, out, size);
+	};
+}
+
+}}	//namespace zindorsky::steganography
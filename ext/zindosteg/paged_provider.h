@@ -0,0 +1,49 @@
+#pragma once
+
+#include "provider.h"
+#include "page_cache.h"
+#include <cstdint>
+
+namespace zindorsky {
+namespace steganography {
+
+//Base for providers whose indexed data lies uncompressed in a file that may be bigger than memory. The file is read through a
+//utils::page_cache, so only its budget of pages is ever held: changed pages that don't fit go to a scratch file, and commits stream the
+//pages out in file order (or, committing to the file itself, write back just the changed ones).
+class paged_provider : public provider_t {
+public:
+	//Page cache budget of paged providers loaded from then on. 64 MB by default.
+	static void set_memory_budget(std::size_t bytes);
+	static std::size_t memory_budget();
+	//BMP and WAV files bigger than this are paged by provider_t::load rather than memory mapped, so that changing more of them than fits
+	//in memory doesn't run out of it. 1 GB by default. Y4M files are always paged.
+	static void set_paging_threshold(std::uint64_t bytes);
+	static std::uint64_t paging_threshold();
+
+	virtual byte & access_indexed_data( index_t index ) override;
+	virtual byte const& access_indexed_data( index_t index ) const override;
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override;
+	virtual void commit_to_file(filesystem::path const& file) override;
+	virtual std::size_t memory_footprint() const override;
+
+protected:
+	paged_provider(filesystem::path const& filename, std::size_t budget);
+	//Holds all of "data" in memory instead.
+	explicit paged_provider(byte_vector && data);
+
+	//File offset of an index.
+	virtual std::uint64_t logical_to_physical( index_t index ) const = 0;
+
+	std::uint64_t file_size() const { return file_.size(); }
+	//Reads bytes as modified so far, without caching the pages they come from (for headers, say). Returns how many were in the file.
+	std::size_t read(std::uint64_t offset, byte * out, std::size_t size) const { return file_.read(offset, out, size); }
+	//Reader over the file, for the format's probe code.
+	header_reader reader() const;
+
+private:
+	//Reading pages in changes the cache, not the carrier.
+	mutable utils::page_cache file_;
+};
+
+}}	//namespace zindorsky::steganography
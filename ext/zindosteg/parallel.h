@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+namespace utils {
+
+//Number of threads worth using for CPU bound work.
+inline std::size_t worker_count()
+{
+	std::size_t n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+//Calls fn(i) for every i in [0,count), splitting the range into contiguous chunks run on separate threads.
+//The calling thread takes the first chunk. The first exception thrown by any call is rethrown once all threads have finished.
+template<class F>
+void parallel_for(std::size_t count, F fn)
+{
+	std::size_t workers = std::min(worker_count(), count);
+	if (workers <= 1) {
+		for(std::size_t i=0; i<count; ++i) {
+			fn(i);
+		}
+		return;
+	}
+
+	std::vector<std::exception_ptr> errors(workers);
+	auto run = [&](std::size_t w) {
+		try {
+			for(std::size_t i = count*w/workers, end = count*(w+1)/workers; i<end; ++i) {
+				fn(i);
+			}
+		} catch(...) {
+			errors[w] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(workers-1);
+	for(std::size_t w=1; w<workers; ++w) {
+		threads.emplace_back(run, w);
+	}
+	run(0);
+	for(auto & t : threads) {
+		t.join();
+	}
+	for(auto & e : errors) {
+		if (e) {
+			std::rethrow_exception(e);
+		}
+	}
+}
+
+}}}	//namespace zindorsky::steganography::utils
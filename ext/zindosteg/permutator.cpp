@@ -2,6 +2,7 @@
 #include <openssl/evp.h>
 #include "steg_endian.h"
 #include <algorithm>
+#include <vector>
 
 namespace zindorsky {
 namespace permutator {
@@ -112,17 +113,75 @@ index_t context::reverse(index_t index) const
 	return retval;
 }
 
+//AES-FFX-A2 encrypt of many indexes, a round at a time
+void context::map(index_t const* in, index_t * out, std::size_t count) const
+{
+	std::copy(in, in + count, out);
+	//Indexes still to encrypt (all of them, then those that need another walk along their chain)
+	std::vector<std::size_t> todo(count);
+	for(std::size_t k=0; k<count; ++k) {
+		todo[k] = k;
+	}
+	std::vector<half_t> A, B;
+	byte_vector Q;
+	while(!todo.empty()) {
+		std::size_t n = todo.size();
+		A.resize(n);
+		B.resize(n);
+		Q.resize(n * AES_BLOCK_SIZE);
+		for(std::size_t k=0; k<n; ++k) {
+			A[k] = static_cast<half_t>( out[todo[k]] & split_mask_[0] );
+			B[k] = static_cast<half_t>( out[todo[k]] >> split_ );
+		}
+
+		for(byte i=0; i<rounds_; ++i) {
+			for(std::size_t k=0; k<n; ++k) {
+				round_input(i, B[k], &Q[k*AES_BLOCK_SIZE]);
+			}
+			key_.encrypt_blocks(Q.data(), Q.data(), n);
+			for(std::size_t k=0; k<n; ++k) {
+				half_t C = A[k] ^ round_output(i, &Q[k*AES_BLOCK_SIZE]);
+				A[k] = B[k];
+				B[k] = C;
+			}
+		}
+
+		std::size_t walking = 0;
+		for(std::size_t k=0; k<n; ++k) {
+			index_t & result = out[todo[k]];
+			result = (static_cast<index_t>(B[k])<<split_) | static_cast<index_t>(A[k]);
+			//Chain-walking:
+			if( result >= size_ ) {
+				todo[walking++] = todo[k];
+			}
+		}
+		todo.resize(walking);
+	}
+}
+
 context::half_t context::F(byte r, half_t B) const
 {
-	byte Q[AES_BLOCK_SIZE] = {0};
+	byte Q[AES_BLOCK_SIZE];
+	round_input(r, B, Q);
+	key_.encrypt(Q,Q);
+	return round_output(r, Q);
+}
+
+void context::round_input(byte r, half_t B, byte * Q) const
+{
+	std::fill_n(Q, AES_BLOCK_SIZE, 0);
 	//Fill out Q. (No tweak in this implementation.)
 	Q[7] = r;
-	endian::write_be(B,&Q[sizeof(Q)-sizeof(B)]);
-	for(std::size_t i=0; i<sizeof(Q); ++i) {
+	endian::write_be(B,&Q[AES_BLOCK_SIZE-sizeof(B)]);
+	for(std::size_t i=0; i<AES_BLOCK_SIZE; ++i) {
 		Q[i] ^= P_templ_[i];	
 	}
-	key_.encrypt(Q,Q);
-	endian::read_be(&Q[sizeof(Q)-sizeof(B)],B);
+}
+
+context::half_t context::round_output(byte r, byte const* Q) const
+{
+	half_t B;
+	endian::read_be(&Q[AES_BLOCK_SIZE-sizeof(B)],B);
 	return B & split_mask_[r%2];
 }
 
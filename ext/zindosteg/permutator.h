@@ -23,6 +23,9 @@ public:
 
 	index_t operator[] (index_t index) const;
 	index_t reverse (index_t index) const;
+	//Same as operator[] on each of "count" indexes, but each round is run on all of them at once so that AES gets long runs of blocks.
+	//Much faster than one index at a time for more than a few.
+	void map(index_t const* in, index_t * out, std::size_t count) const;
 
 private:
 	using half_t = uint_fast32_t;
@@ -34,6 +37,9 @@ private:
 	half_t split_mask_[2];
 
 	half_t F(byte r, half_t B) const;
+	//The block F encrypts, and what F makes of it once encrypted.
+	void round_input(byte r, half_t B, byte * Q) const;
+	half_t round_output(byte r, byte const* Q) const;
 };
 
 }}	//namespace zindorsky::permutator
@@ -0,0 +1,232 @@
+#include "png_deflate.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <png.h>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace zindorsky {
+namespace steganography {
+namespace png {
+
+namespace {
+
+//Filtered bytes per band: large enough that restarting compression at each band costs next to nothing in output size.
+const std::size_t band_sz = 1 << 18;
+
+int paeth(int a, int b, int c)
+{
+	int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2*c);
+	int nearest = pb < pa ? b : a;
+	return pc < std::min(pa, pb) ? c : nearest;
+}
+
+//Cost libpng assigns to a filtered byte when picking a filter: its magnitude as a signed value.
+inline unsigned cost(byte f)
+{
+	return static_cast<unsigned>(std::abs(static_cast<int>(static_cast<signed char>(f))));
+}
+
+//Applies the cheapest of a set of PNG row filters to each row it is given.
+class row_filter {
+public:
+	row_filter(std::size_t row_size, std::size_t pixel_size, int filters)
+		: row_size_(row_size)
+		, pixel_size_(std::min(pixel_size, row_size))
+		, filters_(filters ? filters : PNG_FILTER_NONE)
+		, best_(row_size + 1)
+		, trial_(row_size + 1)
+	{
+	}
+
+	//Writes the filter type byte and the filtered row to out[0..row_size]. "prior" is the row above, all zeros for the first row.
+	void operator () (byte const* row, byte const* prior, byte * out)
+	{
+		std::size_t best_cost = SIZE_MAX;
+		bool choose = (filters_ & (filters_ - 1)) != 0;
+		for(int type = PNG_FILTER_VALUE_NONE; type < PNG_FILTER_VALUE_LAST; ++type) {
+			if (!(filters_ & (PNG_FILTER_NONE << type))) {
+				continue;
+			}
+			std::size_t c = apply(type, row, prior, trial_.data(), choose ? best_cost : SIZE_MAX);
+			if (c < best_cost || !choose) {
+				best_cost = c;
+				best_.swap(trial_);
+			}
+		}
+		std::memcpy(out, best_.data(), best_.size());
+	}
+
+private:
+	std::size_t row_size_, pixel_size_;
+	int filters_;
+	byte_vector best_, trial_;
+
+	//Filters into "out" and returns the total cost of the filtered bytes, giving up (and returning "limit") as soon as it reaches "limit".
+	std::size_t apply(int type, byte const* row, byte const* prior, byte * out, std::size_t limit) const
+	{
+		out[0] = static_cast<byte>(type);
+		byte * f = out + 1;
+		std::size_t const bpp = pixel_size_;
+		//The bytes of the first pixel have no left neighbours; filters take those as zeros.
+		switch(type) {
+		case PNG_FILTER_VALUE_NONE: {
+			auto none = [&](std::size_t i) { return row[i]; };
+			return filter(f, limit, none, none);
+		}
+		case PNG_FILTER_VALUE_SUB:
+			return filter(f, limit,
+				[&](std::size_t i) { return row[i]; },
+				[&](std::size_t i) { return row[i] - row[i - bpp]; });
+		case PNG_FILTER_VALUE_UP: {
+			auto up = [&](std::size_t i) { return row[i] - prior[i]; };
+			return filter(f, limit, up, up);
+		}
+		case PNG_FILTER_VALUE_AVG:
+			return filter(f, limit,
+				[&](std::size_t i) { return row[i] - prior[i] / 2; },
+				[&](std::size_t i) { return row[i] - (row[i - bpp] + prior[i]) / 2; });
+		default:
+			return filter(f, limit,
+				[&](std::size_t i) { return row[i] - prior[i]; },
+				[&](std::size_t i) { return row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]); });
+		}
+	}
+
+	template<class First, class Rest>
+	std::size_t filter(byte * f, std::size_t limit, First first, Rest rest) const
+	{
+		std::size_t total = 0;
+		for(std::size_t i = 0; i < pixel_size_; ++i) {
+			f[i] = static_cast<byte>(first(i));
+			total += cost(f[i]);
+		}
+		//Checked against the limit every block of bytes, as libpng does, so losing filters stop early.
+		for(std::size_t i = pixel_size_; i < row_size_; ) {
+			std::size_t end = std::min(row_size_, i + 256);
+			unsigned sum = 0;
+			for(; i < end; ++i) {
+				f[i] = static_cast<byte>(rest(i));
+				sum += cost(f[i]);
+			}
+			total += sum;
+			if (total >= limit) {
+				return limit;
+			}
+		}
+		return total;
+	}
+};
+
+//Deflates "in" as a raw stream on its own, ending with a full flush (or, for the last band, the final block), so that it can follow
+//any other band's output.
+void deflate_band(byte_vector const& in, bool last, deflate_settings const& settings, byte_vector & out)
+{
+	z_stream zs;
+	std::memset(&zs, 0, sizeof(zs));
+	int strategy = settings.filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	if (deflateInit2(&zs, settings.level, Z_DEFLATED, -15, settings.mem_level, strategy) != Z_OK) {
+		throw std::runtime_error("deflate initialization failed");
+	}
+
+	//Room for the flush marker on top of the worst case expansion.
+	out.resize(deflateBound(&zs, in.size()) + 16);
+	zs.next_in = const_cast<byte*>(in.data());
+	zs.avail_in = static_cast<uInt>(in.size());
+	zs.next_out = out.data();
+	zs.avail_out = static_cast<uInt>(out.size());
+	for(;;) {
+		int ret = deflate(&zs, last ? Z_FINISH : Z_FULL_FLUSH);
+		if (ret == Z_STREAM_END || (!last && ret == Z_OK && zs.avail_in == 0 && zs.avail_out != 0)) {
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			deflateEnd(&zs);
+			throw std::runtime_error("deflate failed");
+		}
+		std::size_t used = out.size() - zs.avail_out;
+		out.resize(out.size() * 2);
+		zs.next_out = out.data() + used;
+		zs.avail_out = static_cast<uInt>(out.size() - used);
+	}
+	out.resize(out.size() - zs.avail_out);
+	out.shrink_to_fit();
+	deflateEnd(&zs);
+}
+
+}	//namespace
+
+void deflated_image::update(std::vector<byte*> const& rows, std::size_t row_size, std::size_t pixel_size, deflate_settings const& settings, std::vector<bool> const& dirty_rows, bool parallel)
+{
+	std::size_t const filtered_row_sz = row_size + 1;
+	std::size_t const rows_per_band = std::max<std::size_t>(1, band_sz / filtered_row_sz);
+	std::size_t const bands = (rows.size() + rows_per_band - 1) / rows_per_band;
+
+	std::vector<std::size_t> todo;
+	if (bands != bands_.size() || rows_per_band != rows_per_band_ || settings.level != settings_.level
+		|| settings.mem_level != settings_.mem_level || settings.filters != settings_.filters)
+	{
+		settings_ = settings;
+		rows_per_band_ = rows_per_band;
+		bands_.assign(bands, compressed_band{});
+		for(std::size_t b=0; b<bands; ++b) {
+			todo.push_back(b);
+		}
+	} else {
+		for(std::size_t b=0; b<bands; ++b) {
+			//The filter of a band's first row also depends on the row before it.
+			std::size_t first = b * rows_per_band, last = std::min(rows.size(), first + rows_per_band);
+			for(std::size_t r = first ? first - 1 : 0; r < last; ++r) {
+				if (r < dirty_rows.size() && dirty_rows[r]) {
+					todo.push_back(b);
+					break;
+				}
+			}
+		}
+	}
+
+	byte_vector const zero_row(row_size, 0);
+	auto encode = [&](std::size_t t) {
+		std::size_t b = todo[t];
+		std::size_t first = b * rows_per_band, last = std::min(rows.size(), first + rows_per_band);
+		row_filter filter(row_size, pixel_size, settings.filters);
+		byte_vector in((last - first) * filtered_row_sz);
+		for(std::size_t r = first; r < last; ++r) {
+			filter(rows[r], r ? rows[r-1] : zero_row.data(), &in[(r - first) * filtered_row_sz]);
+		}
+		bands_[b].checksum = adler32(adler32(0, nullptr, 0), in.data(), static_cast<uInt>(in.size()));
+		bands_[b].length = in.size();
+		deflate_band(in, b + 1 == bands, settings, bands_[b].data);
+	};
+	if (parallel) {
+		utils::parallel_for(todo.size(), encode);
+	} else {
+		for(std::size_t t=0; t<todo.size(); ++t) {
+			encode(t);
+		}
+	}
+}
+
+std::array<byte, 2> deflated_image::header() const
+{
+	//32K window, with the level hint zlib itself would write.
+	int level = settings_.level == Z_DEFAULT_COMPRESSION ? 6 : settings_.level;
+	int level_flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	byte cmf = 0x78, flg = static_cast<byte>(level_flags << 6);
+	flg = static_cast<byte>(flg + 31 - (cmf * 256 + flg) % 31);
+	return {{cmf, flg}};
+}
+
+std::array<byte, 4> deflated_image::trailer() const
+{
+	uLong checksum = adler32(0, nullptr, 0);
+	for(std::size_t b=0; b<bands_.size(); ++b) {
+		checksum = b ? adler32_combine(checksum, bands_[b].checksum, static_cast<z_off_t>(bands_[b].length)) : bands_[b].checksum;
+	}
+	return {{static_cast<byte>(checksum >> 24), static_cast<byte>(checksum >> 16), static_cast<byte>(checksum >> 8), static_cast<byte>(checksum)}};
+}
+
+}}}	//namespace zindorsky::steganography::png
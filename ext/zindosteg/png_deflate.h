@@ -0,0 +1,48 @@
+#pragma once
+
+#include "steg_defs.h"
+#include <array>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+namespace png {
+
+//zlib and row filter settings for encoding image data.
+struct deflate_settings {
+	int level;
+	int mem_level;
+	//PNG_FILTER_* flags of the row filters to choose from. Each row gets the one with the smallest sum of absolute differences, as libpng does.
+	int filters;
+};
+
+//The zlib stream for the IDAT chunks of a non-interlaced image, kept as bands of rows that are compressed independently: each band ends
+//with a full flush, so it doesn't depend on the compressed bytes before it. Kept between commits, only the bands whose rows changed are redone.
+//Bands aren't primed with the window of the band before them: that compresses a little better, but a change would then redo every later band.
+//The whole stream is header(), then every band in order, then trailer(). The output only depends on the image and settings, not on threads.
+class deflated_image {
+public:
+	//Filters and deflates the bands containing rows flagged in "dirty_rows", or every band if the image shape or settings changed since the
+	//last update. A band is also redone when the row just before it changed, since the filter of its first row depends on that row.
+	void update(std::vector<byte*> const& rows, std::size_t row_size, std::size_t pixel_size, deflate_settings const& settings, std::vector<bool> const& dirty_rows, bool parallel);
+
+	std::size_t band_count() const { return bands_.size(); }
+	byte_vector const& band(std::size_t b) const { return bands_[b].data; }
+
+	std::array<byte, 2> header() const;
+	//Adler-32 of the filtered image data, combined from the bands'.
+	std::array<byte, 4> trailer() const;
+
+private:
+	struct compressed_band {
+		byte_vector data;
+		unsigned long checksum = 0;
+		std::size_t length = 0;
+	};
+
+	deflate_settings settings_ = {};
+	std::size_t rows_per_band_ = 0;
+	std::vector<compressed_band> bands_;
+};
+
+}}}	//namespace zindorsky::steganography::png
@@ -1,6 +1,11 @@
 #include "png_provider.h"
 #include <exception>
 #include "file_utils.h"
+#include "mapped_file.h"
+#include "steg_endian.h"
+#include "png_deflate.h"
+#include <algorithm>
+#include <zlib.h>
 #include "string.h"
 
 namespace zindorsky {
@@ -27,14 +32,37 @@ void read_data(png_structp png_ptr, png_bytep data, png_size_t length)
 
 void write_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-  byte_vector* sink = reinterpret_cast<byte_vector*>(png_get_io_ptr(png_ptr));
-  sink->insert(sink->end(), data, data + length);
+  auto sink = reinterpret_cast<sink_writer*>(png_get_io_ptr(png_ptr));
+  sink->write(data, length);
 }
 
 void flush_data(png_structp)
 {
 }
 
+using compression_profile = provider_t::commit_options::compression_profile;
+
+png::deflate_settings settings_for(compression_profile profile)
+{
+  switch(profile) {
+  case compression_profile::fast: return {1, 8, PNG_FILTER_SUB};
+  case compression_profile::balanced: return {5, 8, PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH};
+  case compression_profile::smallest: return {9, 9, PNG_ALL_FILTERS};
+  default: return {Z_DEFAULT_COMPRESSION, 8, PNG_ALL_FILTERS};   //libpng's defaults
+  }
+}
+
+void set_compression(png_structp ptr, compression_profile profile)
+{
+  if(profile == compression_profile::standard) {
+    return;
+  }
+  auto settings = settings_for(profile);
+  png_set_compression_level(ptr, settings.level);
+  png_set_compression_mem_level(ptr, settings.mem_level);
+  png_set_filter(ptr, PNG_FILTER_TYPE_BASE, settings.filters);
+}
+
 } //namespace
 
 const byte png_provider::signature[8] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
@@ -49,7 +77,14 @@ png_provider::png_provider(byte_vector const& data)
 {
 }
 
+png_provider::png_provider(byte_vector && data)
+	: png_provider(data.data(), data.size())
+{
+	byte_vector().swap(data);
+}
+
 png_provider::png_provider(byte const* data, size_t size)
+  : encoded_sz_(size)
 {
   if(size < sizeof(signature) || memcmp(data, signature, sizeof(signature))!=0) {
     throw invalid_carrier();
@@ -86,13 +121,70 @@ png_provider::png_provider(byte const* data, size_t size)
     throw invalid_carrier("palette using PNG files not supported");
   }
 
-  auto row_size = png_get_rowbytes(ctx_->ptr, ctx_->info);
+  auto row_size = row_size_ = png_get_rowbytes(ctx_->ptr, ctx_->info);
+  dirty_rows_.assign(height_, false);
   data_.resize(row_size * height_);
   row_pointers_.resize(height_);
   for(auto i = 0U; i < height_; ++i) {
     row_pointers_[i] = &data_[0] + i * row_size;
   }
-  png_read_image(ctx_->ptr, &row_pointers_[0]);
+
+  //Same as png_read_image, except that the salt is sampled from each row of the final pass as soon as it is decoded.
+  int passes = png_set_interlace_handling(ctx_->ptr);
+  png_start_read_image(ctx_->ptr);
+  for(int pass = 1; pass < passes; ++pass) {
+    png_read_rows(ctx_->ptr, &row_pointers_[0], nullptr, height_);
+  }
+  byte salt[8]={0};
+  std::size_t next = 0;
+  for(auto i = 0U; i < height_; ++i) {
+    png_read_row(ctx_->ptr, row_pointers_[i], nullptr);
+    for(; next < height_ && adjust_index(next*width_ + next%width_) < (i+1) * row_size; ++next) {
+      salt[ next%sizeof(salt) ] += data_[adjust_index(next*width_ + next%width_)]>>1;
+    }
+  }
+  salt_.assign(salt,salt+sizeof(salt));
+}
+
+provider_t::carrier_info png_provider::probe(header_reader const& read)
+{
+  //Signature followed by the IHDR chunk, which the PNG spec requires to come first.
+  byte header[sizeof(signature) + 4 + 4 + 13];
+  if(read(0, header, sizeof(header)) < sizeof(header) || memcmp(header, signature, sizeof(signature))!=0
+      || memcmp(&header[sizeof(signature) + 4], "IHDR", 4)!=0) {
+    throw invalid_carrier();
+  }
+
+  byte const* ihdr = &header[sizeof(signature) + 8];
+  std::uint32_t width, height;
+  endian::read_be(&ihdr[0], width);
+  endian::read_be(&ihdr[4], height);
+  int bit_depth = ihdr[8], color_type = ihdr[9];
+
+  if( width==0 || height==0
+      || (color_type==0 && bit_depth!=1 && bit_depth!=2 && bit_depth!=4 && bit_depth!=8 && bit_depth!=16)
+      || ((color_type==2 || color_type==4 || color_type==6) && bit_depth!=8 && bit_depth!=16)
+      || (color_type==3 &&bit_depth!=1 && bit_depth!=2 && bit_depth!=4 && bit_depth!=8)
+      || color_type==1 || color_type==5 || color_type>6
+    ) {
+    throw invalid_carrier();
+  }
+  if(bit_depth < 8) {
+    throw invalid_carrier("PNG bit depth too small");
+  }
+  if(color_type & 1) {
+    throw invalid_carrier("palette using PNG files not supported");
+  }
+
+  //One sample per channel: gray, -, RGB, -, gray+alpha, -, RGBA
+  static const int channels[] = { 1, 0, 3, 0, 2, 0, 4 };
+
+  carrier_info info;
+  info.format = format();
+  info.width = width;
+  info.height = height;
+  info.size = index_t(width) * height * channels[color_type];
+  return info;
 }
 
 provider_t::index_t png_provider::size() const
@@ -102,7 +194,10 @@ provider_t::index_t png_provider::size() const
 
 byte & png_provider::access_indexed_data(provider_t::index_t index)
 {
-    return data_[adjust_index(index)];
+    size_t i = adjust_index(index);
+    //Only writes come through here, so the row has to be compressed again on the next commit.
+    dirty_rows_[i / row_size_] = true;
+    return data_[i];
 }
 
 byte const& png_provider::access_indexed_data(index_t index) const
@@ -110,25 +205,28 @@ byte const& png_provider::access_indexed_data(index_t index) const
     return data_[adjust_index(index)];
 }
 
-byte_vector png_provider::commit_to_memory()
+void png_provider::commit_to_memory(memory_sink & sink)
 {
-	byte_vector data;
+  bool banded = update_idat();
+  //the re-encoded file is usually close in size to the original
+  sink_writer writer(sink, encoded_sz_ + encoded_sz_/8);
   png_write_ctx write_ctx;
   if (setjmp(png_jmpbuf(write_ctx.ptr))) {
     throw std::exception();
   }
-  png_set_write_fn(write_ctx.ptr, &data, write_data, flush_data);
+  png_set_write_fn(write_ctx.ptr, &writer, write_data, flush_data);
   write_ctx.copy_from_read(*ctx_);
+  set_compression(write_ctx.ptr, options_.compression);
+  write_image(write_ctx, banded);
 
-  png_write_info(write_ctx.ptr, write_ctx.info);
-  png_write_image(write_ctx.ptr, &row_pointers_[0]);
-  png_write_end(write_ctx.ptr, nullptr);
-
-	return data;
+  writer.finish();
 }
 
 void png_provider::commit_to_file(filesystem::path const& file)
 {
+  bool banded = update_idat();
+  //The file is written in place, under any mapping of it.
+  utils::detach_shared_mappings(file);
   FILE *f = fopen(file.string().c_str(), "wb");
   png_write_ctx write_ctx;
   if (setjmp(png_jmpbuf(write_ctx.ptr))) {
@@ -137,21 +235,57 @@ void png_provider::commit_to_file(filesystem::path const& file)
   }
   png_init_io(write_ctx.ptr, f);
   write_ctx.copy_from_read(*ctx_);
-
-  png_write_info(write_ctx.ptr, write_ctx.info);
-  png_write_image(write_ctx.ptr, &row_pointers_[0]);
-  png_write_end(write_ctx.ptr, nullptr);
+  set_compression(write_ctx.ptr, options_.compression);
+  write_image(write_ctx, banded);
   fclose(f);
 }
 
-byte_vector png_provider::salt() const
+bool png_provider::update_idat()
 {
-	byte salt[8]={0};
-	for(std::size_t i=0; i<height_; ++i) {
-		salt[ i%sizeof(salt) ] += access_indexed_data(i*width_ + i%width_)>>1;
-	}	
+  //Interlaced images keep going through libpng, which does the pass splitting. So does the first commit with libpng's defaults on a single
+  //thread, which stays exactly what libpng writes; from the next one on, only the bands that changed are compressed again.
+  if(png_get_interlace_type(ctx_->ptr, ctx_->info) != PNG_INTERLACE_NONE) {
+    return false;
+  }
+  if(options_.compression == compression_profile::standard && !options_.parallel && !written_by_libpng_) {
+    written_by_libpng_ = true;
+    return false;
+  }
+  size_t pixel_size = png_get_channels(ctx_->ptr, ctx_->info) * (bit_depth_ / 8);
+  idat_.update(row_pointers_, row_size_, pixel_size, settings_for(options_.compression), dirty_rows_, options_.parallel);
+  dirty_rows_.assign(dirty_rows_.size(), false);
+  return true;
+}
 
-	return byte_vector(salt,salt+sizeof(salt));
+void png_provider::write_image(png_write_ctx & write_ctx, bool banded)
+{
+  png_write_info(write_ctx.ptr, write_ctx.info);
+  if(!banded) {
+    png_write_image(write_ctx.ptr, &row_pointers_[0]);
+    png_write_end(write_ctx.ptr, nullptr);
+    return;
+  }
+
+  //One IDAT chunk per band, the zlib header going in the first and the checksum in the last.
+  auto header = idat_.header();
+  auto trailer = idat_.trailer();
+  auto idat = reinterpret_cast<png_const_bytep>("IDAT");
+  for(size_t b = 0, bands = idat_.band_count(); b < bands; ++b) {
+    auto const& data = idat_.band(b);
+    bool first = b == 0, last = b + 1 == bands;
+    png_write_chunk_start(write_ctx.ptr, idat, data.size() + (first ? header.size() : 0) + (last ? trailer.size() : 0));
+    if(first) {
+      png_write_chunk_data(write_ctx.ptr, header.data(), header.size());
+    }
+    png_write_chunk_data(write_ctx.ptr, data.data(), data.size());
+    if(last) {
+      png_write_chunk_data(write_ctx.ptr, trailer.data(), trailer.size());
+    }
+    png_write_chunk_end(write_ctx.ptr);
+  }
+  //png_write_end only works after libpng has written the image data itself. Nothing is left for it to write after IDAT but IEND,
+  //since the image was read without png_read_end (so there are no chunks from after the image data to copy).
+  png_write_chunk(write_ctx.ptr, reinterpret_cast<png_const_bytep>("IEND"), nullptr, 0);
 }
 
 size_t png_provider::adjust_index(size_t index) const
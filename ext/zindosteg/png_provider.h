@@ -1,6 +1,7 @@
 #pragma once
 
 #include "provider.h"
+#include "png_deflate.h"
 #include <vector>
 #include <cstdint>
 #include <png.h>
@@ -55,6 +56,8 @@ namespace zindorsky {
       public:
         explicit png_provider(filesystem::path const& filename);
         explicit png_provider(byte_vector const& data);
+        //Takes ownership of "data" and frees it as soon as the image is decoded.
+        explicit png_provider(byte_vector && data);
         png_provider(byte const* data, size_t size);
 
         //Non-copyable:
@@ -65,12 +68,15 @@ namespace zindorsky {
         png_provider & operator = (png_provider &&) = default;
 
         static std::string format() { return "PNG"; }
+        static carrier_info probe(header_reader const& read);
         virtual index_t size() const override;
         virtual byte & access_indexed_data(index_t index) override;
         virtual byte const& access_indexed_data(index_t index) const override;
-        virtual byte_vector commit_to_memory() override;
+        using provider_t::commit_to_memory;
+        virtual void commit_to_memory(memory_sink & sink) override;
         virtual void commit_to_file(filesystem::path const& file) override;
-        virtual byte_vector salt() const override;
+        virtual byte_vector const& salt() const override { return salt_; }
+        virtual std::size_t memory_footprint() const override { return data_.size(); }
 
         static const byte signature[8];
 
@@ -79,9 +85,21 @@ namespace zindorsky {
         byte_vector data_;
         std::vector<byte*> row_pointers_;
         std::uint32_t width_, height_;
+        //size of the file we were loaded from
+        std::size_t encoded_sz_;
         byte bit_depth_, color_type_;
+        byte_vector salt_;
+        size_t row_size_;
+        //Compressed image data from the last commit, and the rows written to since then.
+        png::deflated_image idat_;
+        std::vector<bool> dirty_rows_;
+        //Whether libpng has written the carrier since it was loaded.
+        bool written_by_libpng_ = false;
 
         size_t adjust_index(size_t index) const;
+        //Brings idat_ up to date with the image, returning false if the image has to be written by libpng instead.
+        bool update_idat();
+        void write_image(png_write_ctx & write_ctx, bool banded);
     }; 
 
   }}	//namespace zindorsky::steganography
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "steg_defs.h"
+#include "memory_sink.h"
 #include <vector>
 #include <memory>
 #include <cstdint>
 #include <exception>
+#include <functional>
+#include <string>
 
 namespace zindorsky {
 namespace steganography {
@@ -21,20 +24,79 @@ public:
 	static std::unique_ptr<provider_t> load(filesystem::path const& file);
 	//Loads from memory. Caller retains ownership of buffer.
 	static std::unique_ptr<provider_t> load(void const* data, size_t size);
+	//Loads from memory, taking ownership of the buffer.
+	static std::unique_ptr<provider_t> load(byte_vector && data);
+	//Loads from memory without copying it. JPEG, PNG and Y4M carriers only read the buffer during the call.
+	//BMP and WAV carriers are modified in place, so the buffer must stay valid, and must not be modified by anyone else, until the provider is destroyed.
+	static std::unique_ptr<provider_t> load(byte_span data);
 
 	static std::vector<std::string> supported_formats();
 
 	using index_t = uint_fast64_t;
 
+	//What can be learned about a carrier from its headers alone.
+	struct carrier_info {
+		std::string format;
+		std::uint32_t width = 0, height = 0;
+		//What size() will return once the carrier is loaded.
+		index_t size = 0;
+	};
+
+	//Parses only the headers of a carrier, without decoding any image data. Throws invalid_carrier for files load() would reject.
+	static carrier_info probe(filesystem::path const& file);
+	static carrier_info probe(void const* data, size_t size);
+
+	//Reads up to "size" bytes at "offset" of a carrier into "out", returning how many were read. Used by the format specific probes.
+	using header_reader = std::function<size_t(size_t offset, byte * out, size_t size)>;
+
+	//Settings for how a provider re-encodes its carrier on commit.
+	struct commit_options {
+		//Encode on multiple threads where the format allows it.
+		//JPEG output gets a restart marker after every MCU row so that the rows can be entropy coded independently.
+		//Non-interlaced PNG output is compressed in bands of rows, which are then deflated on multiple threads.
+		bool parallel = false;
+
+		//Speed/size trade-off for formats that are losslessly recompressed (PNG).
+		enum class compression_profile {
+			standard,	//the codec's own defaults
+			fast,		//low zlib level with a fixed row filter
+			balanced,	//moderate zlib level with a small adaptive filter search
+			smallest,	//zlib level 9 with a search over every row filter
+		};
+		compression_profile compression = compression_profile::standard;
+
+		//Wait until committed data has reached the disk (fdatasync). Honoured by in-place commits of mapped BMP and WAV carriers.
+		bool durable = false;
+	};
+
 	virtual ~provider_t() {}
 
+	void set_commit_options(commit_options const& options) { options_ = options; }
+	commit_options const& get_commit_options() const { return options_; }
+
 	virtual index_t size() const = 0;
 	virtual byte & access_indexed_data(index_t index) = 0;
 	virtual byte const& access_indexed_data( index_t index ) const = 0;
-	virtual byte_vector commit_to_memory() = 0;
+	//Writes the carrier into "sink".
+	virtual void commit_to_memory(memory_sink & sink) = 0;
+	byte_vector commit_to_memory() { vector_sink sink; commit_to_memory(sink); return sink.release(); }
 	virtual void commit_to_file(filesystem::path const& file) = 0;
-	virtual byte_vector salt() const = 0;
+	//Derived from bits that hiding data doesn't change. Computed once, while the carrier is loaded.
+	virtual byte_vector const& salt() const = 0;
+	//Bytes of memory held for the carrier, not counting what is mapped from files. Used to size caches of providers.
+	virtual std::size_t memory_footprint() const = 0;
+	//Whether the const accessors may be called from several threads at once. Not so for providers that page their data in as it's read.
+	virtual bool concurrent_reads() const { return true; }
+
+	//Wraps "provider" so that it can be cloned; the result behaves exactly like "provider" did.
+	static std::unique_ptr<provider_t> with_snapshots(std::unique_ptr<provider_t> provider);
+	//Copy-on-write snapshot, for trying out several payloads (or passwords) on one carrier: the snapshot shares the decoded data with
+	//this provider, and each of them only copies the blocks of it they write to. Committing one doesn't affect the others.
+	//Supported by providers from with_snapshots() or the provider cache, and by their snapshots; others throw std::logic_error.
+	virtual std::unique_ptr<provider_t> clone();
 
+protected:
+	commit_options options_;
 };
 
 }}	//namespace zindorsky::steganography
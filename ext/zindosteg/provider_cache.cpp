@@ -0,0 +1,124 @@
+#include "provider_cache.h"
+#include "cow_provider.h"
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace zindorsky {
+namespace steganography {
+namespace provider_cache {
+
+namespace {
+
+struct entry {
+	std::string key;
+	std::shared_ptr<provider_t const> provider;
+	std::shared_ptr<utils::shared_mapping> encoded;
+	std::size_t bytes;
+};
+
+std::mutex cache_mutex;
+std::size_t cache_limit = 0;
+statistics cache_stats;
+//Most recently used first.
+std::list<entry> lru;
+std::unordered_map<std::string, std::list<entry>::iterator> entries;
+
+//Canonical path, device, inode, size and modification time.
+std::string identity_key(utils::shared_mapping const& file)
+{
+	std::error_code ec;
+	filesystem::path canonical = filesystem::canonical(file.path(), ec);
+	std::string key = (ec ? filesystem::absolute(file.path()) : canonical).string();
+	//as fstat reported them for the descriptor that was mapped, so they describe the very bytes being decoded
+	utils::mapped_file::file_identity const& id = file.identity();
+	key += '\0';
+	key += std::to_string(id.size);
+	key += ':';
+	key += std::to_string(id.modified);
+	key += ':';
+	key += std::to_string(id.device);
+	key += ':';
+	key += std::to_string(id.inode);
+	return key;
+}
+
+//Only call with cache_mutex held.
+void evict_to(std::size_t bytes)
+{
+	while (!lru.empty() && cache_stats.resident_bytes > bytes) {
+		cache_stats.resident_bytes -= lru.back().bytes;
+		entries.erase(lru.back().key);
+		lru.pop_back();
+		++cache_stats.evictions;
+	}
+	cache_stats.entries = lru.size();
+}
+
+std::unique_ptr<provider_t> view(entry const& e, decoder const& decode)
+{
+	std::shared_ptr<utils::shared_mapping> encoded = e.encoded;
+	return std::make_unique<cow_provider>(e.provider, [encoded, decode]() {
+		byte_span bytes = encoded->bytes();
+		return decode(bytes.data(), bytes.size(), encoded);
+	});
+}
+
+}	//namespace
+
+void set_limit(std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	cache_limit = bytes;
+	evict_to(bytes);
+}
+
+std::size_t limit()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	return cache_limit;
+}
+
+statistics stats()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	return cache_stats;
+}
+
+std::unique_ptr<provider_t> load(std::shared_ptr<utils::shared_mapping> const& file, decoder const& decode)
+{
+	std::string key = identity_key(*file);
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			lru.splice(lru.begin(), lru, it->second);
+			++cache_stats.hits;
+			return view(*it->second, decode);
+		}
+		++cache_stats.misses;
+	}
+
+	//Decoded without holding the lock, so other carriers can be loaded meanwhile.
+	byte_span encoded = file->bytes();
+	std::unique_ptr<provider_t> provider = decode(encoded.data(), encoded.size(), file);
+	std::size_t bytes = provider->memory_footprint() + file->memory_footprint();
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	//Views of an entry read it from any thread.
+	if (bytes > cache_limit || !provider->concurrent_reads()) {
+		return provider;
+	}
+	auto it = entries.find(key);
+	if (it == entries.end()) {
+		lru.push_front(entry{key, std::shared_ptr<provider_t const>(std::move(provider)), file, bytes});
+		it = entries.emplace(key, lru.begin()).first;
+		cache_stats.resident_bytes += bytes;
+		evict_to(cache_limit);
+	}
+	return view(*it->second, decode);
+}
+
+}}}	//namespace zindorsky::steganography::provider_cache
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "provider.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace zindorsky {
+namespace steganography {
+namespace provider_cache {
+
+//Process-wide cache of decoded JPEG and PNG providers for long-running processes that keep opening the same carriers. Entries are keyed
+//by the file's canonical path and identity (device, inode, size and modification time of the file that was mapped), so a changed file is
+//simply a miss; the least recently used entries are evicted to keep the memory they hold under the limit. Each load gets a cow_provider
+//view of the cached provider, which costs nothing until it's written to. A limit of 0 (the default) turns the cache off and drops every
+//entry.
+void set_limit(std::size_t bytes);
+std::size_t limit();
+
+struct statistics {
+	std::uint64_t hits = 0, misses = 0, evictions = 0;
+	//Entries held, and the memory they hold: their providers' memory_footprint() plus their encoded carriers, where those aren't mapped.
+	std::size_t entries = 0, resident_bytes = 0;
+};
+
+statistics stats();
+
+//Decodes a carrier into its provider. "file" is the mapping "data" lie in, which the provider may keep instead of a copy.
+using decoder = std::function<std::unique_ptr<provider_t>(byte const* data, std::size_t size, std::shared_ptr<utils::shared_mapping> const& file)>;
+
+//Returns a view of the cached provider for the mapped "file", first decoding it with "decode" on a miss. The entry keeps the mapping
+//(which is detached, that is copied, only if the file is written over), and views decode it again (with "decode") when they are committed.
+//Carriers too big to fit under the limit on their own, or whose providers can't be read from several threads at once, are decoded and
+//returned without being cached.
+std::unique_ptr<provider_t> load(std::shared_ptr<utils::shared_mapping> const& file, decoder const& decode);
+
+}}}	//namespace zindorsky::steganography::provider_cache
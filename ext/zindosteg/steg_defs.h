@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <vector>
 #if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 9
 # define EXPERIMENTAL_FILESYSTEM
@@ -13,6 +14,27 @@ namespace zindorsky {
 using byte = unsigned char;
 using byte_vector = std::vector<byte>;
 
+//Non-owning view of a contiguous range of memory. Whoever hands one out says how long the memory stays valid.
+template<class T>
+class basic_span {
+public:
+	basic_span() = default;
+	basic_span(T * data, std::size_t size) : data_(data), size_(size) {}
+
+	T * data() const { return data_; }
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	T * begin() const { return data_; }
+	T * end() const { return data_ + size_; }
+	T & operator [] (std::size_t i) const { return data_[i]; }
+
+private:
+	T * data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+using byte_span = basic_span<byte>;
+
 #if defined(EXPERIMENTAL_FILESYSTEM)
 # include <experimental/filesystem>
 namespace filesystem = std::experimental::filesystem;
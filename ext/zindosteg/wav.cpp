@@ -0,0 +1,279 @@
+#include "wav.h"
+#include "steg_endian.h"
+#include "file_utils.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace zindorsky {
+namespace steganography {
+
+namespace {
+	//Samples spread over the whole recording that go into the salt; a fixed number, so loading stays cheap however long the audio is.
+	const std::size_t salt_sample_count = 1024;
+
+	const std::uint16_t format_pcm = 1, format_extensible = 0xfffe;
+
+	std::uint16_t read_le16(byte const* p)
+	{
+		return static_cast<std::uint16_t>((int(p[1])<<8) | p[0]);
+	}
+
+	struct wav_layout {
+		std::uint16_t channels;
+		std::size_t sample_sz;
+		std::size_t data_offset;
+		std::size_t data_sz;
+	};
+
+	//Walks the RIFF chunks up to "data", checking the "fmt " chunk before it on the way.
+	wav_layout read_layout(provider_t::header_reader const& read)
+	{
+		byte riff[12];
+		if (read(0, riff, sizeof(riff)) < sizeof(riff) || std::memcmp(riff, "RIFF", 4) != 0 || std::memcmp(&riff[8], "WAVE", 4) != 0) {
+			throw invalid_carrier();
+		}
+
+		wav_layout layout = {};
+		bool have_format = false;
+		std::size_t pos = sizeof(riff);
+		for(;;) {
+			byte chunk[8];
+			if (read(pos, chunk, sizeof(chunk)) < sizeof(chunk)) {
+				throw invalid_carrier();
+			}
+			std::uint32_t chunk_sz;
+			endian::read_le(&chunk[4], chunk_sz);
+			pos += sizeof(chunk);
+
+			if (std::memcmp(chunk, "fmt ", 4) == 0) {
+				byte fmt[40] = {0};
+				std::size_t n = read(pos, fmt, std::min<std::size_t>(chunk_sz, sizeof(fmt)));
+				if (n < 16) {
+					throw invalid_carrier();
+				}
+				std::uint16_t tag = read_le16(&fmt[0]), block_align = read_le16(&fmt[12]), bits = read_le16(&fmt[14]);
+				layout.channels = read_le16(&fmt[2]);
+				if (tag == format_extensible) {
+					//The sub format GUID starts with the plain format tag. Samples with padding bits below the valid ones aren't supported:
+					//their low byte isn't noise.
+					if (n < 40 || read_le16(&fmt[18]) != bits) {
+						throw std::runtime_error("unsupported WAV format");
+					}
+					tag = read_le16(&fmt[24]);
+				}
+				//only 16 and 24-bit integer PCM (8-bit samples are too coarse, and the low byte of a float isn't its least significant part)
+				if (tag != format_pcm || (bits != 16 && bits != 24) || layout.channels == 0 || block_align != layout.channels * (bits / 8)) {
+					throw std::runtime_error("unsupported WAV format");
+				}
+				layout.sample_sz = bits / 8;
+				have_format = true;
+			} else if (std::memcmp(chunk, "data", 4) == 0) {
+				if (!have_format) {
+					throw invalid_carrier();
+				}
+				layout.data_offset = pos;
+				layout.data_sz = chunk_sz;
+				return layout;
+			}
+			//chunks are padded to an even size
+			pos += chunk_sz + (chunk_sz & 1);
+		}
+	}
+
+	//Recorders that were cut off (or stream their output) leave the data size unset or too big: only whole samples in the file count.
+	std::uint64_t whole_samples(wav_layout const& layout, std::uint64_t file_sz)
+	{
+		std::uint64_t data_sz = std::min<std::uint64_t>(layout.data_sz, file_sz - std::min<std::uint64_t>(layout.data_offset, file_sz));
+		return data_sz / layout.sample_sz;
+	}
+
+	//Where the file read by "read" ends, if that's before "claimed": found by bisecting with one byte reads. Bytes before "start" are known
+	//to be there.
+	std::uint64_t readable_extent(provider_t::header_reader const& read, std::uint64_t start, std::uint64_t claimed)
+	{
+		byte b;
+		if (claimed <= start || read(static_cast<std::size_t>(claimed - 1), &b, 1) == 1) {
+			return claimed;
+		}
+		//bytes before "lo" are there; the one at "hi" isn't
+		std::uint64_t lo = start, hi = claimed - 1;
+		while (lo < hi) {
+			std::uint64_t mid = lo + (hi - lo) / 2;
+			if (read(static_cast<std::size_t>(mid), &b, 1) == 1) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	//Samples are little endian, so the low byte is the first one; >>1 leaves out the bit steganography changes. "sample(index)" reads the
+	//low byte of a sample, so mapped and paged providers of a file come up with the same salt.
+	template<class Sample>
+	byte_vector sample_salt(std::uint64_t sample_count, Sample const& sample)
+	{
+		byte salt[8]={0};
+		std::uint64_t count = std::min<std::uint64_t>(sample_count, salt_sample_count);
+		for(std::uint64_t i=0; i<count; ++i) {
+			salt[ i%sizeof(salt) ] += sample(i * sample_count / count)>>1;
+		}
+		return byte_vector(salt,salt+sizeof(salt));
+	}
+}
+
+wav_provider::wav_provider( filesystem::path const& filename )
+	: wav_provider( filename, utils::mapped_file::mode::private_copy )
+{
+}
+
+wav_provider::wav_provider( filesystem::path const& filename, utils::mapped_file::mode mode )
+	: wav_provider( utils::mapped_file(filename, mode) )
+{
+}
+
+wav_provider::wav_provider( utils::mapped_file && file )
+	: mapping_(std::move(file))
+	, file_(mapping_.data(), mapping_.size())
+{
+	init();
+	//The payload is scattered all over the samples.
+	mapping_.advise_random();
+	track_changes_ = mapping_.get_mode() == utils::mapped_file::mode::private_copy;
+	if (track_changes_) {
+		changed_ = utils::dirty_blocks(mapping_.size());
+	}
+}
+
+wav_provider::wav_provider(byte const* data, size_t size)
+	: wav_provider( byte_vector(data, data+size) )
+{
+}
+
+wav_provider::wav_provider(byte_vector const& data)
+	: wav_provider(data.data(), data.size())
+{
+}
+
+wav_provider::wav_provider(byte_vector && data)
+	: storage_(std::move(data))
+	, file_(storage_.data(), storage_.size())
+{
+	init();
+}
+
+wav_provider::wav_provider(byte_span data)
+	: file_(data)
+{
+	init();
+}
+
+wav_provider::wav_provider(wav_provider const& other)
+	: wav_provider( byte_vector(other.file_.begin(), other.file_.end()) )
+{
+}
+
+wav_provider & wav_provider::operator = (wav_provider const& other)
+{
+	if (this != &other) {
+		*this = wav_provider(other);
+	}
+	return *this;
+}
+
+void wav_provider::init()
+{
+	wav_layout layout = read_layout([this](size_t offset, byte * out, size_t size) -> size_t {
+		if (offset >= file_.size()) {
+			return 0;
+		}
+		size = std::min(size, file_.size() - offset);
+		std::memcpy(out, file_.data() + offset, size);
+		return size;
+	});
+
+	data_ = file_.data() + std::min(layout.data_offset, file_.size());
+	sample_sz_ = layout.sample_sz;
+	sample_count_ = static_cast<std::size_t>(whole_samples(layout, file_.size()));
+	salt_ = sample_salt(sample_count_, [this](index_t sample) { return data_[static_cast<std::size_t>(sample) * sample_sz_]; });
+}
+
+provider_t::carrier_info wav_provider::probe(header_reader const& read)
+{
+	wav_layout layout = read_layout(read);
+	//the same whole samples load() counts
+	std::uint64_t samples = whole_samples(layout, readable_extent(read, layout.data_offset, std::uint64_t(layout.data_offset) + layout.data_sz));
+
+	carrier_info info;
+	info.format = format();
+	info.width = layout.channels;
+	info.height = static_cast<uint32_t>(samples / layout.channels);
+	info.size = index_t(samples);
+	return info;
+}
+
+provider_t::index_t wav_provider::size() const
+{
+	return sample_count_;
+}
+
+byte & wav_provider::access_indexed_data( index_t index )
+{
+	std::size_t pos = static_cast<std::size_t>(index) * sample_sz_;
+	if (track_changes_) {
+		changed_.mark(static_cast<std::size_t>(data_ - file_.data()) + pos);
+	}
+	return *(data_ + pos);
+}
+
+byte const& wav_provider::access_indexed_data( index_t index ) const
+{
+	return *(data_ + static_cast<std::size_t>(index) * sample_sz_);
+}
+
+void wav_provider::commit_to_memory(memory_sink & sink)
+{
+	std::memcpy(sink.reserve(file_.size()), file_.data(), file_.size());
+	sink.commit(file_.size());
+}
+
+void wav_provider::commit_to_file(filesystem::path const& file)
+{
+	std::error_code ec;
+	if (!mapping_.empty() && filesystem::equivalent(file, mapping_.path(), ec)) {
+		if (mapping_.get_mode() == utils::mapped_file::mode::shared) {
+			mapping_.sync();
+			return;
+		}
+		//Only the changed blocks are written, in place; rewriting (let alone truncating) the file isn't needed.
+		mapping_.write_back(changed_.ranges(), options_.durable);
+		changed_.clear();
+		return;
+	}
+	utils::save_to_file(file, file_.data(), file_.size());
+}
+
+paged_wav_provider::paged_wav_provider( filesystem::path const& filename, std::size_t cache_budget )
+	: paged_provider(filename, cache_budget)
+{
+	wav_layout layout = read_layout(reader());
+	data_offset_ = layout.data_offset;
+	sample_sz_ = layout.sample_sz;
+	sample_count_ = whole_samples(layout, file_size());
+	//read through the const overload, which doesn't mark the pages changed
+	provider_t const& self = *this;
+	salt_ = sample_salt(sample_count_, [&self](index_t sample) { return self.access_indexed_data(sample); });
+}
+
+provider_t::index_t paged_wav_provider::size() const
+{
+	return sample_count_;
+}
+
+std::uint64_t paged_wav_provider::logical_to_physical( index_t index ) const
+{
+	return data_offset_ + index * sample_sz_;
+}
+
+}}	//namespace zindorsky::steganography
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "provider.h"
+#include "mapped_file.h"
+#include "paged_provider.h"
+#include <cstdint>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+
+//16 or 24-bit PCM audio in a RIFF/WAVE file. The indexed data is the low (least significant) byte of every sample, read and modified right
+//where it lies in the file: nothing is decoded, so loading costs the same for a second of audio as for hours of it.
+class wav_provider : public provider_t {
+public:
+	//Maps the file privately, so loading reads only the header and only the pages the payload touches are faulted in.
+	explicit wav_provider( filesystem::path const& filename );
+	//With mapped_file::mode::shared, writes go straight to the file and committing to it only flushes them.
+	wav_provider( filesystem::path const& filename, utils::mapped_file::mode mode );
+	explicit wav_provider( utils::mapped_file && file );
+	wav_provider(byte const* data, size_t size);
+	explicit wav_provider(byte_vector const& data);
+	explicit wav_provider(byte_vector && data);
+	//Borrows "data" without copying it; samples are read and modified in place. The memory must outlive the provider.
+	explicit wav_provider(byte_span data);
+	//Copyable. A copy always owns its own bytes, even when copied from a borrowing provider.
+	wav_provider(wav_provider const& other);
+	wav_provider & operator = (wav_provider const& other);
+	//Movable
+	wav_provider(wav_provider &&) = default;
+	wav_provider & operator = (wav_provider &&) = default;
+
+	static std::string format() { return "WAV"; }
+	//Reports the channel count as the width and the number of sample frames as the height.
+	static carrier_info probe(header_reader const& read);
+
+	virtual index_t size() const override;
+	virtual byte & access_indexed_data( index_t index ) override;
+	virtual byte const& access_indexed_data( index_t index ) const override;
+	using provider_t::commit_to_memory;
+	virtual void commit_to_memory(memory_sink & sink) override;
+	virtual void commit_to_file(filesystem::path const& file) override;
+	virtual byte_vector const& salt() const override { return salt_; }
+	virtual std::size_t memory_footprint() const override { return storage_.size(); }
+
+private:
+	//Owned bytes of the file; empty when borrowing or mapped.
+	byte_vector storage_;
+	utils::mapped_file mapping_;
+	//The whole file, in storage_, mapping_ or borrowed memory.
+	byte_span file_;
+	//Blocks written to since the privately mapped file was last committed to its own path; only those are written back.
+	utils::dirty_blocks changed_;
+	bool track_changes_ = false;
+	//Start of the samples, and the bytes per sample.
+	byte *data_;
+	std::size_t sample_sz_, sample_count_;
+	byte_vector salt_;
+
+	void init();
+};
+
+//A WAV paged in under a bounded memory budget rather than mapped, for files too big to change in memory. Has the same indexed data and
+//salt as wav_provider.
+class paged_wav_provider : public paged_provider {
+public:
+	explicit paged_wav_provider( filesystem::path const& filename, std::size_t cache_budget = paged_provider::memory_budget() );
+
+	static std::string format() { return wav_provider::format(); }
+
+	virtual index_t size() const override;
+	virtual byte_vector const& salt() const override { return salt_; }
+
+protected:
+	virtual std::uint64_t logical_to_physical( index_t index ) const override;
+
+private:
+	std::uint64_t data_offset_, sample_sz_, sample_count_;
+	byte_vector salt_;
+};
+
+}}	//namespace zindorsky::steganography
@@ -0,0 +1,159 @@
+#include "y4m.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace zindorsky {
+namespace steganography {
+
+namespace {
+	const char stream_magic[] = "YUV4MPEG2 ";
+	const std::size_t max_stream_header_sz = 4096, max_frame_header_sz = 256;
+	//Samples spread over the whole video that go into the salt; a fixed number, so loading stays cheap however long the video is.
+	const std::size_t salt_sample_count = 256;
+
+	struct y4m_layout {
+		std::uint32_t width = 0, height = 0;
+		std::uint64_t frame_sz = 0;
+		std::vector<std::uint64_t> frame_offsets;
+	};
+
+	//Bytes of samples in a frame. Only 8-bit colour spaces are supported: the low byte of deeper samples isn't the first one in every file.
+	std::uint64_t frame_size(std::uint32_t width, std::uint32_t height, std::string const& colorspace)
+	{
+		std::uint64_t luma = std::uint64_t(width) * height, half_width = (std::uint64_t(width) + 1) / 2;
+		//4:2:0 (the default) comes with different chroma siting, which doesn't matter here
+		if (colorspace.empty() || colorspace == "420" || colorspace == "420jpeg" || colorspace == "420paldv" || colorspace == "420mpeg2") {
+			return luma + 2 * half_width * ((std::uint64_t(height) + 1) / 2);
+		}
+		if (colorspace == "422") {
+			return luma + 2 * half_width * height;
+		}
+		if (colorspace == "411") {
+			return luma + 2 * ((std::uint64_t(width) + 3) / 4) * height;
+		}
+		if (colorspace == "444") {
+			return 3 * luma;
+		}
+		if (colorspace == "444alpha") {
+			return 4 * luma;
+		}
+		if (colorspace == "mono") {
+			return luma;
+		}
+		throw std::runtime_error("unsupported Y4M format");
+	}
+
+	//Parses the stream header, then hops from frame header to frame header to find where every frame's samples start.
+	y4m_layout read_layout(provider_t::header_reader const& read)
+	{
+		char header[max_stream_header_sz];
+		std::size_t n = read(0, reinterpret_cast<byte*>(header), sizeof(header));
+		std::size_t magic_len = sizeof(stream_magic) - 1;
+		char const* end = static_cast<char const*>(std::memchr(header, '\n', n));
+		if (n < magic_len || std::memcmp(header, stream_magic, magic_len) != 0 || !end) {
+			throw invalid_carrier();
+		}
+
+		y4m_layout layout;
+		std::string colorspace;
+		for(char const* p = header + magic_len; p < end; ) {
+			char const* token_end = std::find(p, end, ' ');
+			if (token_end != p) {
+				std::string value(p + 1, token_end);
+				switch(*p) {
+				case 'W': layout.width = static_cast<std::uint32_t>(std::strtoul(value.c_str(), nullptr, 10)); break;
+				case 'H': layout.height = static_cast<std::uint32_t>(std::strtoul(value.c_str(), nullptr, 10)); break;
+				case 'C': colorspace = value; break;
+				default: break;
+				}
+			}
+			p = token_end + 1;
+		}
+		if (layout.width == 0 || layout.height == 0) {
+			throw invalid_carrier();
+		}
+		layout.frame_sz = frame_size(layout.width, layout.height, colorspace);
+
+		std::uint64_t pos = static_cast<std::uint64_t>(end - header) + 1;
+		for(;;) {
+			byte frame_header[max_frame_header_sz];
+			n = read(static_cast<std::size_t>(pos), frame_header, sizeof(frame_header));
+			//a file cut off in the middle of a frame header just ends there
+			if (n < 6) {
+				break;
+			}
+			byte const* newline = static_cast<byte const*>(std::memchr(frame_header, '\n', n));
+			if (std::memcmp(frame_header, "FRAME", 5) != 0 || !newline) {
+				throw invalid_carrier();
+			}
+			std::uint64_t samples = pos + static_cast<std::uint64_t>(newline - frame_header) + 1;
+			layout.frame_offsets.push_back(samples);
+			pos = samples + layout.frame_sz;
+		}
+		//nor does a frame cut off in the middle of its samples count
+		byte last;
+		if (!layout.frame_offsets.empty() && read(static_cast<std::size_t>(pos - 1), &last, 1) != 1) {
+			layout.frame_offsets.pop_back();
+		}
+		return layout;
+	}
+}
+
+y4m_provider::y4m_provider( filesystem::path const& filename, std::size_t cache_budget )
+	: paged_provider(filename, cache_budget)
+{
+	init();
+}
+
+y4m_provider::y4m_provider(byte const* data, size_t size)
+	: y4m_provider( byte_vector(data, data+size) )
+{
+}
+
+y4m_provider::y4m_provider(byte_vector && data)
+	: paged_provider(std::move(data))
+{
+	init();
+}
+
+void y4m_provider::init()
+{
+	y4m_layout layout = read_layout(reader());
+	frame_offsets_ = std::move(layout.frame_offsets);
+	frame_sz_ = layout.frame_sz;
+
+	//read through the const overload, which doesn't mark the pages changed
+	provider_t const& self = *this;
+	byte salt[8]={0};
+	index_t count = std::min<index_t>(size(), salt_sample_count);
+	for(index_t i=0; i<count; ++i) {
+		salt[ i%sizeof(salt) ] += self.access_indexed_data(i * (size() / count))>>1;
+	}
+	salt_.assign(salt,salt+sizeof(salt));
+}
+
+provider_t::carrier_info y4m_provider::probe(header_reader const& read)
+{
+	y4m_layout layout = read_layout(read);
+
+	carrier_info info;
+	info.format = format();
+	info.width = layout.width;
+	info.height = layout.height;
+	info.size = index_t(layout.frame_sz * layout.frame_offsets.size());
+	return info;
+}
+
+provider_t::index_t y4m_provider::size() const
+{
+	return frame_sz_ * frame_offsets_.size();
+}
+
+std::uint64_t y4m_provider::logical_to_physical( index_t index ) const
+{
+	return frame_offsets_[static_cast<std::size_t>(index / frame_sz_)] + index % frame_sz_;
+}
+
+}}	//namespace zindorsky::steganography
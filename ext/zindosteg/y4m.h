@@ -0,0 +1,42 @@
+#pragma once
+
+#include "paged_provider.h"
+#include <cstdint>
+#include <vector>
+
+namespace zindorsky {
+namespace steganography {
+
+//Uncompressed 8-bit YUV4MPEG2 video. The indexed data is every sample (luma, then chroma, then alpha if any) of every frame, in file order.
+//Files are never loaded: samples are paged in under a bounded budget, so carriers of many GB only need that much memory.
+class y4m_provider : public paged_provider {
+public:
+	explicit y4m_provider( filesystem::path const& filename, std::size_t cache_budget = paged_provider::memory_budget() );
+	y4m_provider(byte const* data, size_t size);
+	explicit y4m_provider(byte_vector && data);
+	//Non-copyable:
+	y4m_provider(y4m_provider const&) = delete;
+	y4m_provider & operator = (y4m_provider const&) = delete;
+	//Movable:
+	y4m_provider(y4m_provider &&) = default;
+	y4m_provider & operator = (y4m_provider &&) = default;
+
+	static std::string format() { return "Y4M"; }
+	static carrier_info probe(header_reader const& read);
+
+	virtual index_t size() const override;
+	virtual byte_vector const& salt() const override { return salt_; }
+
+protected:
+	virtual std::uint64_t logical_to_physical( index_t index ) const override;
+
+private:
+	//File offset of the samples of each frame, past its FRAME header.
+	std::vector<std::uint64_t> frame_offsets_;
+	std::uint64_t frame_sz_;
+	byte_vector salt_;
+
+	void init();
+};
+
+}}	//namespace zindorsky::steganography
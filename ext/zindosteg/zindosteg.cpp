@@ -1,10 +1,20 @@
 #include <rice/rice.hpp>
 #include <rice/stl.hpp>
 #include "device.h"
+#include "decoded_cache.h"
+#include "provider_cache.h"
+#include "paged_provider.h"
+#include "jpeg_memory.h"
 #include "hmac.h"
 #include "key_generator.h"
 #include "aes.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <utility>
+#include <vector>
 
 using namespace Rice;
 using namespace zindorsky;
@@ -114,6 +124,42 @@ namespace {
     }
   };
 
+  //Commits carriers straight into a binary Ruby String.
+  class string_sink : public steganography::memory_sink {
+  public:
+    string_sink() : str_{rb_str_new(nullptr, 0)} {}
+
+    byte * reserve(size_t size) override
+    {
+      if (static_cast<size_t>(RSTRING_LEN(str_)) < size) {
+        rb_str_resize(str_, static_cast<long>(size));
+      }
+      return reinterpret_cast<byte*>(RSTRING_PTR(str_));
+    }
+
+    void commit(size_t size) override
+    {
+      rb_str_set_len(str_, static_cast<long>(size));
+    }
+
+    String str() const { return String(str_); }
+
+  private:
+    VALUE str_;
+  };
+
+  using compression_profile = steganography::provider_t::commit_options::compression_profile;
+
+  const std::pair<char const*, compression_profile> compression_profiles[] = {
+    {"default", compression_profile::standard},
+    {"fast", compression_profile::fast},
+    {"balanced", compression_profile::balanced},
+    {"smallest", compression_profile::smallest},
+  };
+
+  //Payload read ahead at a time by the reading methods.
+  const long read_ahead_sz = 0x2000;
+
   struct key_cstr_helper {
     explicit key_cstr_helper(zindorsky::crypto::key_generator const& generator) { generator.generate(data,sizeof(data)); }
     byte data[32+AES_BLOCK_SIZE];
@@ -176,6 +222,42 @@ namespace {
     device_interface & operator = (device_interface &&) = default;
 
     bool autoclose() const { return true; }
+
+    //Compression profile ("default", "fast", "balanced" or "smallest") used when the carrier is next written. Only PNG carriers are affected.
+    std::string compression() const
+    {
+      auto profile = device_.get_commit_options().compression;
+      for (auto const& p : compression_profiles) {
+        if (p.second == profile) {
+          return p.first;
+        }
+      }
+      return "default";
+    }
+
+    void set_compression(std::string const& name)
+    {
+      for (auto const& p : compression_profiles) {
+        if (name == p.first) {
+          auto options = device_.get_commit_options();
+          options.compression = p.second;
+          device_.set_commit_options(options);
+          return;
+        }
+      }
+      throw argumentError("unknown compression profile: " + name);
+    }
+
+    //Whether the carrier is re-encoded on multiple threads when it's next written (JPEG and PNG carriers).
+    bool parallel() const { return device_.get_commit_options().parallel; }
+
+    void set_parallel(bool enable)
+    {
+      auto options = device_.get_commit_options();
+      options.parallel = enable;
+      device_.set_commit_options(options);
+    }
+
     void enable_binmode() { mode_.binary = true; }
     bool binmode() const { return mode_.binary; }
     long capacity() const { return max_sz_; }
@@ -241,34 +323,36 @@ namespace {
       check_closed();
       //remember where we are so we can seek back after updating the HMAC:
       long orig = pos_;
-      if (dirty_) {
-        //Write HMAC after the payload
-        unsigned char hmac[crypto::hmac::digest_sz];
-        compute_hmac(hmac);
-        encryptor_.crypt(hmac, hmac, sizeof(hmac));
-        device_.write(reinterpret_cast<char const *>(hmac), sizeof(hmac));
-      }
+      write_hmac();
       device_.flush();
       dirty_ = false;
       seek(orig);
     }
 
+    //Returns the carrier, including any unflushed writes, as a binary String. The carrier file isn't touched.
+    String carrier_data()
+    {
+      check_closed();
+      long orig = pos_;
+      write_hmac();
+      string_sink sink;
+      device_.write_to_memory(sink);
+      dirty_ = false;
+      seek(orig);
+      return sink.str();
+    }
+
     Object getbyte()
     {
       check_closed();
       check_read();
 
-      if (eof()) {
+      if (eof() || !buffer_ahead(1)) {
         return {};
       }
 
-      char c;
-      auto r = device_.read(&c, 1);
-      if (r <= 0) {
-        return {};
-      }
-      encryptor_.crypt(&c, &c, 1);
-      pos_++;
+      char c = ahead_[ahead_pos_];
+      consume_ahead(1);
       return detail::To_Ruby<int>().convert(static_cast<unsigned char>(c));
     }
 
@@ -276,17 +360,12 @@ namespace {
     {
       check_closed();
       check_read();
-      if (eof()) {
+      if (eof() || !buffer_ahead(1)) {
         return {};
       }
 
-      char c;
-      auto r = device_.read(&c, 1);
-      if (r <= 0) {
-        return {};
-      }
-      encryptor_.crypt(&c, &c, 1);
-      pos_++;
+      char c = ahead_[ahead_pos_];
+      consume_ahead(1);
       return String(std::string(&c, 1));
     }
 
@@ -316,26 +395,7 @@ namespace {
       if (lim == 0) {
         return String{};
       }
-      std::string str;
-      if (lim > 0) {
-        str.reserve(static_cast<std::string::size_type>(lim));
-      }
-      while(
-        !eof()
-        && (lim < 0 || str.size() < static_cast<std::string::size_type>(lim))
-        && (separator.empty() || (str.size() < separator.size() || str.substr(str.size() - separator.size()) != separator))
-        )
-      {
-        char c;
-        auto r = device_.read(&c, 1);
-        if (r <= 0) {
-          break;
-        }
-        encryptor_.crypt(&c, &c, 1);
-        pos_++;
-        str += c;
-      }
-      return detail::To_Ruby<std::string>().convert(str);
+      return next_line(separator, lim);
     }
 
     bool isatty() const { return false; }
@@ -404,10 +464,17 @@ namespace {
       }
 
       auto ptr = StringValuePtr(out);
-      auto r = device_.read(ptr, toread);
-      encryptor_.crypt(ptr, ptr, static_cast<size_t>(r));
-      pos_ += static_cast<long>(r);
-      rb_str_resize(out, static_cast<long>(r));
+      //What was read ahead first, then straight from the device (which is past it)
+      long buffered = std::min(toread, static_cast<long>(ahead_.size() - ahead_pos_));
+      memcpy(ptr, ahead_.data() + ahead_pos_, static_cast<size_t>(buffered));
+      consume_ahead(buffered);
+      long r = 0;
+      if (toread > buffered) {
+        r = std::max<long>(0, static_cast<long>(device_.read(ptr + buffered, toread - buffered)));
+        encryptor_.crypt(ptr + buffered, ptr + buffered, static_cast<size_t>(r));
+        pos_ += r;
+      }
+      rb_str_resize(out, buffered + r);
       return out;
     }
 
@@ -464,29 +531,9 @@ namespace {
       if (lim == 0) {
         return Array{};
       }
-      std::string str;
-      if (lim > 0) {
-        str.reserve(static_cast<std::string::size_type>(lim));
-      }
       Array arr;
       while(!eof()) {
-        str.clear();
-        while(
-          !eof()
-          && (lim < 0 || str.size() < static_cast<std::string::size_type>(lim))
-          && (separator.empty() || (str.size() < separator.size() || str.substr(str.size() - separator.size()) != separator))
-          )
-        {
-          char c;
-          auto r = device_.read(&c, 1);
-          if (r <= 0) {
-            break;
-          }
-          encryptor_.crypt(&c, &c, 1);
-          pos_++;
-          str += c;
-        }
-        arr.push(String(detail::To_Ruby<std::string>().convert(str)));
+        arr.push(next_line(separator, lim));
       }
       return arr;
     }
@@ -499,6 +546,8 @@ namespace {
     {
       check_closed();
 
+      ahead_.clear();
+      ahead_pos_ = 0;
       std::streampos newpos = device_.seek(off, static_cast<std::ios::seekdir>(way));
       //No seeking past EOF. (To resize the file, use write or truncate.)
       if (newpos > sz_) {
@@ -526,6 +575,7 @@ namespace {
     {
       check_closed();
       check_write();
+      drop_read_ahead();
 
       if (size == sz_) {
         return;
@@ -554,6 +604,7 @@ namespace {
       check_closed();
       check_write();
       check_append();
+      drop_read_ahead();
 
       auto len = static_cast<long>(s.length());
       if (pos_ > sz_) {
@@ -563,17 +614,23 @@ namespace {
         len = max_sz_ - pos_;
       }
 
-      //Encrypt and write to device
+      //Encrypt and write to device a chunk at a time
+      char buff[0x1000];
       char const *d = s.c_str();
-      long sz = len, start = pos_;
-      char c;
-      while (sz-- > 0)
+      long start = pos_;
+      while (pos_ - start < len)
       {
-        encryptor_.crypt(d++, &c, 1);
-        if (device_.write(&c, 1) != 1) {
+        size_t towrite = std::min(static_cast<size_t>(len - (pos_ - start)), sizeof(buff));
+        encryptor_.crypt(d + (pos_ - start), buff, towrite);
+        auto r = device_.write(buff, static_cast<std::streamsize>(towrite));
+        if (r > 0) {
+          pos_ += static_cast<long>(r);
+        }
+        if (r != static_cast<std::streamsize>(towrite)) {
+          //the keystream ran ahead of what the device took
+          encryptor_.seek(pos_);
           break;
         }
-        ++pos_;
       }
       //Update size if we wrote past current end
       if (pos_ > sz_) {
@@ -592,6 +649,10 @@ namespace {
     crypto::hmac hmac_;
     mode mode_;
     bool closed_, dirty_;
+    //Decrypted payload read ahead of pos_ by the reading methods; the bytes from ahead_pos_ on are those at pos_ onwards. While any
+    //are held, the device and the encryptor are past pos_.
+    std::vector<char> ahead_;
+    size_t ahead_pos_ = 0;
 
     //delegate constructors
     device_interface( steganography::device_t && device, std::string const& password, mode const& mode )
@@ -612,6 +673,91 @@ namespace {
     {
     }
 
+    //Makes sure at least "n" bytes are read ahead, reading a block at a time; false if the payload ends first.
+    bool buffer_ahead(size_t n)
+    {
+      while (ahead_.size() - ahead_pos_ < n) {
+        long buffered = static_cast<long>(ahead_.size() - ahead_pos_);
+        long toread = std::min(read_ahead_sz, sz_ - pos_ - buffered);
+        if (toread <= 0) {
+          return false;
+        }
+        //keep only what hasn't been consumed
+        ahead_.erase(ahead_.begin(), ahead_.begin() + static_cast<long>(ahead_pos_));
+        ahead_pos_ = 0;
+        size_t old = ahead_.size();
+        ahead_.resize(old + static_cast<size_t>(toread));
+        auto r = device_.read(&ahead_[old], toread);
+        if (r <= 0) {
+          ahead_.resize(old);
+          return false;
+        }
+        encryptor_.crypt(&ahead_[old], &ahead_[old], static_cast<size_t>(r));
+        ahead_.resize(old + static_cast<size_t>(r));
+      }
+      return true;
+    }
+
+    void consume_ahead(long n)
+    {
+      ahead_pos_ += static_cast<size_t>(n);
+      pos_ += n;
+    }
+
+    //Puts the device back at pos_ before it's written to.
+    void drop_read_ahead()
+    {
+      if (ahead_pos_ < ahead_.size()) {
+        seek(pos_);
+      }
+      ahead_.clear();
+      ahead_pos_ = 0;
+    }
+
+    //Reads the line at pos_: up to and including the next "separator" (the rest of the payload if it's empty), but no more than "lim"
+    //bytes if "lim" isn't negative. The separator is looked for with memchr (or a Boyer-Moore-Horspool search, for longer ones) in
+    //what's read ahead, reading further ahead as needed, and the line is made straight from the buffer.
+    String next_line(std::string const& separator, long lim)
+    {
+      size_t limit = lim < 0 ? std::numeric_limits<size_t>::max() : static_cast<size_t>(lim);
+      size_t len = 0, searched = 0;
+      for (;;) {
+        size_t avail = std::min(ahead_.size() - ahead_pos_, limit);
+        char const* line = ahead_.data() + ahead_pos_;
+        if (!separator.empty() && avail >= separator.size()) {
+          //a separator could straddle what was searched and what's new
+          size_t from = searched >= separator.size() ? searched - (separator.size() - 1) : 0;
+          char const* end = line + avail;
+          char const* hit = separator.size() == 1
+            ? static_cast<char const*>(memchr(line + from, separator[0], avail - from))
+            : std::search(line + from, end, std::boyer_moore_horspool_searcher(separator.begin(), separator.end()));
+          if (hit && hit != end) {
+            len = static_cast<size_t>(hit - line) + separator.size();
+            break;
+          }
+        }
+        searched = avail;
+        if (avail >= limit || !buffer_ahead(ahead_.size() - ahead_pos_ + 1)) {
+          len = avail;
+          break;
+        }
+      }
+      String str{detail::protect(rb_external_str_new, ahead_.data() + ahead_pos_, static_cast<long>(len))};
+      consume_ahead(static_cast<long>(len));
+      return str;
+    }
+
+    //Writes the HMAC after the payload if it has changed. File pointer will be at EOF afterwards.
+    void write_hmac()
+    {
+      if (dirty_) {
+        unsigned char hmac[crypto::hmac::digest_sz];
+        compute_hmac(hmac);
+        encryptor_.crypt(hmac, hmac, sizeof(hmac));
+        device_.write(reinterpret_cast<char const *>(hmac), sizeof(hmac));
+      }
+    }
+
     //Computes HMAC of payload. File pointer will be at EOF afterwards.
     void compute_hmac(unsigned char * hmac)
     {
@@ -656,12 +802,98 @@ namespace {
       }
     }
   };
+
+  //How many bytes a carrier could hide, found from its headers alone (nothing is decoded or decrypted).
+  long capacity(std::string const& carrier_file)
+  {
+    auto info = steganography::provider_t::probe(filesystem::path{carrier_file});
+    return std::max<long>(0, static_cast<long>(steganography::device_t::capacity_for(info.size) - crypto::hmac::digest_sz));
+  }
+
+  //Where decoded JPEG and PNG carriers are kept between opens; "" turns the cache off.
+  std::string cache_directory()
+  {
+    return steganography::decoded_cache::directory().string();
+  }
+
+  void set_cache_directory(std::string const& dir)
+  {
+    steganography::decoded_cache::set_directory(filesystem::path{dir});
+  }
+
+  //Memory limit of the in-process cache of decoded JPEG and PNG carriers; 0 turns it off.
+  size_t provider_cache_limit()
+  {
+    return steganography::provider_cache::limit();
+  }
+
+  void set_provider_cache_limit(size_t bytes)
+  {
+    steganography::provider_cache::set_limit(bytes);
+  }
+
+  //Memory budget of each paged carrier (Y4M, and BMP or WAV past the paging threshold).
+  size_t paged_memory_budget()
+  {
+    return steganography::paged_provider::memory_budget();
+  }
+
+  void set_paged_memory_budget(size_t bytes)
+  {
+    steganography::paged_provider::set_memory_budget(bytes);
+  }
+
+  //Size past which BMP and WAV carriers are paged rather than memory mapped.
+  unsigned long long paging_threshold()
+  {
+    return steganography::paged_provider::paging_threshold();
+  }
+
+  void set_paging_threshold(unsigned long long bytes)
+  {
+    steganography::paged_provider::set_paging_threshold(bytes);
+  }
+
+  //Memory for the coefficients of each JPEG carrier opened from then on; the rest is paged to a temp file. 0 means unlimited.
+  size_t jpeg_memory_budget()
+  {
+    return steganography::jpeg::memory_budget();
+  }
+
+  void set_jpeg_memory_budget(size_t bytes)
+  {
+    steganography::jpeg::set_memory_budget(bytes);
+  }
+
+  Hash provider_cache_stats()
+  {
+    auto stats = steganography::provider_cache::stats();
+    Hash result;
+    result[Symbol("hits")] = stats.hits;
+    result[Symbol("misses")] = stats.misses;
+    result[Symbol("evictions")] = stats.evictions;
+    result[Symbol("entries")] = stats.entries;
+    result[Symbol("resident_bytes")] = stats.resident_bytes;
+    return result;
+  }
 }
 
 extern "C" void Init_zindosteg()
 {
   Module rb_cModule = define_module("Zindosteg");
   register_handler<rubyError>(handle_ruby_error);
+  rb_cModule.define_module_function("capacity", &capacity, Arg("carrier"));
+  rb_cModule.define_module_function("cache_directory", &cache_directory);
+  rb_cModule.define_module_function("cache_directory=", &set_cache_directory, Arg("dir"));
+  rb_cModule.define_module_function("provider_cache_limit", &provider_cache_limit);
+  rb_cModule.define_module_function("provider_cache_limit=", &set_provider_cache_limit, Arg("bytes"));
+  rb_cModule.define_module_function("provider_cache_stats", &provider_cache_stats);
+  rb_cModule.define_module_function("paged_memory_budget", &paged_memory_budget);
+  rb_cModule.define_module_function("paged_memory_budget=", &set_paged_memory_budget, Arg("bytes"));
+  rb_cModule.define_module_function("paging_threshold", &paging_threshold);
+  rb_cModule.define_module_function("paging_threshold=", &set_paging_threshold, Arg("bytes"));
+  rb_cModule.define_module_function("jpeg_memory_budget", &jpeg_memory_budget);
+  rb_cModule.define_module_function("jpeg_memory_budget=", &set_jpeg_memory_budget, Arg("bytes"));
 
   Data_Type<device_interface> rb_cZindosteg =
     define_class_under<device_interface>(rb_cModule, "File")
@@ -671,7 +903,10 @@ extern "C" void Init_zindosteg()
     .define_method("binmode", &device_interface::enable_binmode)
     .define_method("binmode?", &device_interface::binmode)
     .define_method("capacity", &device_interface::capacity)
+    .define_method("carrier_data", &device_interface::carrier_data)
     .define_method("closed?", &device_interface::closed)
+    .define_method("compression", &device_interface::compression)
+    .define_method("compression=", &device_interface::set_compression)
     .define_method("close", &device_interface::close)
     .define_method("each", &device_interface::each, Arg("sep") = Object(), Arg("limit") = Object())
     .define_method("each_byte", &device_interface::each_byte)
@@ -685,6 +920,8 @@ extern "C" void Init_zindosteg()
     .define_method("gets", &device_interface::gets, Arg("sep") = Object(), Arg("limit") = Object())
     .define_method("isatty", &device_interface::isatty)
     .define_method("mode", &device_interface::get_mode)
+    .define_method("parallel", &device_interface::parallel)
+    .define_method("parallel=", &device_interface::set_parallel)
     .define_method("pos", &device_interface::tell)
     .define_method("pos=", &device_interface::set_pos)
     .define_method("print", &device_interface::write)
@@ -0,0 +1,133 @@
+require "zlib"
+
+# Builds small carrier files for the specs, and reads back what the formats that get re-encoded contain.
+module Carriers
+  module_function
+
+  PNG_SIGNATURE = "\x89PNG\r\n\x1A\n".b
+  PNG_CHANNELS = { 0 => 1, 2 => 3, 4 => 2, 6 => 4 }.freeze
+  FIXTURES = ::File.expand_path("fixtures", __dir__)
+
+  # A copy of one of the JPEGs in spec/fixtures, since writing a carrier changes it.
+  def fixture(name, dir)
+    path = ::File.join(dir, name)
+    ::File.binwrite(path, ::File.binread(::File.join(FIXTURES, name)))
+    path
+  end
+
+  # Samples with some structure and some noise, so that they compress like a photo rather than like random data.
+  def samples(count, seed)
+    rng = Random.new(seed)
+    Array.new(count) { |i| (i * 7 / 5 + rng.rand(6)) & 0xff }.pack("C*")
+  end
+
+  def png_chunk(type, data)
+    [data.bytesize].pack("N") + type + data + [Zlib.crc32(type + data)].pack("N")
+  end
+
+  # A non-interlaced PNG of the given color type and bit depth, with unfiltered rows.
+  def png(path, width:, height:, color_type: 2, bit_depth: 8, seed: 1)
+    row_bytes = width * PNG_CHANNELS.fetch(color_type) * bit_depth / 8
+    pixels = samples(row_bytes * height, seed)
+    raw = (0...height).map { |y| "\0".b + pixels.byteslice(y * row_bytes, row_bytes) }.join
+    header = [width, height, bit_depth, color_type, 0, 0, 0].pack("NNCCCCC")
+    ::File.binwrite(path, PNG_SIGNATURE + png_chunk("IHDR", header) + png_chunk("IDAT", Zlib::Deflate.deflate(raw)) + png_chunk("IEND", ""))
+    pixels
+  end
+
+  # The unfiltered image data of a non-interlaced PNG. Checks every chunk CRC, and Zlib the stream's checksum.
+  def png_pixels(path)
+    data = ::File.binread(path)
+    raise "not a PNG" unless data.byteslice(0, 8) == PNG_SIGNATURE
+    pos = 8
+    idat = +""
+    width = height = bpp = nil
+    while pos < data.bytesize
+      length = data.byteslice(pos, 4).unpack1("N")
+      type = data.byteslice(pos + 4, 4)
+      body = data.byteslice(pos + 8, length)
+      raise "bad CRC in #{type}" unless data.byteslice(pos + 8 + length, 4).unpack1("N") == Zlib.crc32(type + body)
+      case type
+      when "IHDR"
+        width, height, bit_depth, color_type, _, _, interlace = body.unpack("NNCCCCC")
+        raise "interlaced" unless interlace.zero?
+        bpp = PNG_CHANNELS.fetch(color_type) * bit_depth / 8
+      when "IDAT"
+        idat << body
+      end
+      pos += 12 + length
+    end
+    unfilter(Zlib::Inflate.inflate(idat).bytes, width * bpp, height, bpp).pack("C*")
+  end
+
+  def unfilter(raw, row_bytes, height, bpp)
+    out = []
+    prior = Array.new(row_bytes, 0)
+    height.times do |y|
+      filter = raw[y * (row_bytes + 1)]
+      row = raw[y * (row_bytes + 1) + 1, row_bytes]
+      row_bytes.times do |x|
+        a = x >= bpp ? row[x - bpp] : 0
+        b = prior[x]
+        c = x >= bpp ? prior[x - bpp] : 0
+        row[x] = (row[x] + case filter
+                           when 0 then 0
+                           when 1 then a
+                           when 2 then b
+                           when 3 then (a + b) / 2
+                           when 4 then paeth(a, b, c)
+                           else raise "bad filter #{filter}"
+                           end) & 0xff
+      end
+      out.concat(row)
+      prior = row
+    end
+    out
+  end
+
+  def paeth(a, b, c)
+    p = a + b - c
+    pa = (p - a).abs
+    pb = (p - b).abs
+    pc = (p - c).abs
+    if pa <= pb && pa <= pc then a
+    elsif pb <= pc then b
+    else c
+    end
+  end
+
+  # A PCM WAV file. Returns the whole file.
+  def wav(path, channels: 2, frames: 100_000, bits: 16, seed: 1)
+    bytes = channels * bits / 8
+    samples = samples(frames * bytes, seed)
+    format = [1, channels, 44_100, 44_100 * bytes, bytes, bits].pack("vvVVvv")
+    body = "WAVE".b + "fmt ".b + [format.bytesize].pack("V") + format + "data".b + [samples.bytesize].pack("V") + samples
+    data = "RIFF".b + [body.bytesize].pack("V") + body
+    ::File.binwrite(path, data)
+    data
+  end
+
+  # A YUV4MPEG2 video of 4:2:0 frames. Returns the whole file.
+  def y4m(path, width: 320, height: 240, frames: 4, seed: 1)
+    frame_bytes = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2)
+    data = "YUV4MPEG2 W#{width} H#{height} F25:1 Ip A1:1 C420jpeg\n".b
+    frames.times { |i| data << "FRAME\n".b << samples(frame_bytes, seed + i) }
+    ::File.binwrite(path, data)
+    data
+  end
+
+  # A bottom-up 24-bit BMP. Returns the whole file.
+  def bmp(path, width: 301, height: 200, seed: 1)
+    stride = (width * 3 + 3) & ~3
+    pixels = samples(stride * height, seed)
+    info = [40, width, height, 1, 24, 0, pixels.bytesize, 2835, 2835, 0, 0].pack("Vl<l<vvVVl<l<VV")
+    data = "BM".b + [14 + info.bytesize + pixels.bytesize, 0, 14 + info.bytesize].pack("VVV") + info + pixels
+    ::File.binwrite(path, data)
+    data
+  end
+
+  # True if the two strings only differ in the lowest bit of their bytes.
+  def lsb_only?(a, b)
+    a.bytesize == b.bytesize && a.bytes.zip(b.bytes).all? { |x, y| (x ^ y) <= 1 }
+  end
+end
@@ -1,5 +1,7 @@
 require "bundler/setup"
 require "zindosteg"
+require "tmpdir"
+require_relative "carriers"
 
 RSpec.configure do |config|
   # Enable flags like --only-failures and --next-failure
@@ -1,9 +1,310 @@
+require "stringio"
+
 RSpec.describe Zindosteg do
+  let(:payload) { Random.new(7).bytes(1500) }
+
+  # Writes "data" into the carrier at "path" and closes it, after setting the given attributes (compression:, parallel:).
+  def embed(path, data, password = "password", **options)
+    file = Zindosteg::File.open(path, password, "w")
+    options.each { |name, value| file.public_send("#{name}=", value) }
+    file.write(data)
+    file.close
+  end
+
+  def extract(path, password = "password")
+    file = Zindosteg::File.open(path, password)
+    file.read
+  ensure
+    file&.close
+  end
+
   it "has a version number" do
     expect(Zindosteg::VERSION).not_to be nil
   end
 
-  it "does something useful" do
-    expect(false).to eq(true)
+  describe "JPEG carriers" do
+    after { Zindosteg.jpeg_memory_budget = 0 }
+
+    %w[rst.jpg rst422.jpg rst_gray.jpg plain.jpg progressive.jpg].product([false, true]).each do |name, parallel|
+      it "round trip a payload through #{name}#{parallel ? ' written in parallel' : ''}" do
+        Dir.mktmpdir do |dir|
+          path = Carriers.fixture(name, dir)
+          embed(path, payload, parallel: parallel)
+          expect(extract(path)).to eq(payload)
+
+          # A budget too small for the coefficients makes libjpeg decode them, and page them out.
+          Zindosteg.jpeg_memory_budget = 1
+          expect(extract(path)).to eq(payload)
+        end
+      end
+    end
+
+    %w[rst.jpg rst422.jpg rst_gray.jpg].each do |name|
+      it "decode the restart intervals of #{name} into the same coefficients as libjpeg" do
+        Dir.mktmpdir do |dir|
+          ours = Carriers.fixture(name, dir)
+          embed(ours, payload)
+          # With the coefficients paged out, libjpeg's jpeg_read_coefficients decodes the carrier and libjpeg encodes it again.
+          Zindosteg.jpeg_memory_budget = 1
+          theirs = ::File.join(dir, "libjpeg.jpg")
+          ::File.binwrite(theirs, ::File.binread(::File.join(Carriers::FIXTURES, name)))
+          embed(theirs, payload)
+
+          # Hiding the same payload changes the same coefficients only if both decoders agreed on every one of them. Our splice of
+          # the touched intervals then decodes (with libjpeg) to exactly what libjpeg wrote from its own coefficients.
+          file = Zindosteg::File.open(ours, "password")
+          expect(file.carrier_data).to eq(::File.binread(theirs))
+          file.close
+        end
+      end
+    end
+  end
+
+  describe "carrier_data" do
+    {
+      "JPEG" => ->(path) { ::File.binwrite(path, ::File.binread(::File.join(Carriers::FIXTURES, "rst.jpg"))) },
+      "PNG" => ->(path) { Carriers.png(path, width: 256, height: 256) },
+      "BMP" => ->(path) { Carriers.bmp(path) },
+      "WAV" => ->(path) { Carriers.wav(path) },
+    }.each do |kind, generate|
+      it "hands back a written #{kind} carrier without changing the file" do
+        Dir.mktmpdir do |dir|
+          path = ::File.join(dir, "carrier")
+          generate.call(path)
+          original = ::File.binread(path)
+
+          # Neither cache is on, so the carrier is committed from the provider loaded for this file alone.
+          file = Zindosteg::File.open(path, "password", "w")
+          file.write(payload)
+          copy = ::File.join(dir, "copy")
+          ::File.binwrite(copy, file.carrier_data)
+          expect(::File.binread(path)).to eq(original)
+          expect(extract(copy)).to eq(payload)
+
+          # Still open, and still writing to the file when it's closed.
+          file.close
+          expect(extract(path)).to eq(payload)
+        end
+      end
+    end
+  end
+
+  describe ".capacity" do
+    {
+      "baseline JPEG" => ->(path) { ::File.binwrite(path, ::File.binread(::File.join(Carriers::FIXTURES, "plain.jpg"))) },
+      "progressive JPEG" => ->(path) { ::File.binwrite(path, ::File.binread(::File.join(Carriers::FIXTURES, "progressive.jpg"))) },
+      "PNG" => ->(path) { Carriers.png(path, width: 256, height: 192) },
+      "16-bit PNG" => ->(path) { Carriers.png(path, width: 100, height: 80, color_type: 6, bit_depth: 16) },
+      "BMP" => ->(path) { Carriers.bmp(path) },
+      "WAV" => ->(path) { Carriers.wav(path, channels: 1, bits: 24) },
+      "Y4M" => ->(path) { Carriers.y4m(path) },
+    }.each do |kind, generate|
+      it "reads a #{kind} carrier's capacity from its headers" do
+        Dir.mktmpdir do |dir|
+          path = ::File.join(dir, "carrier")
+          generate.call(path)
+          file = Zindosteg::File.open(path, "password", "w")
+          expect(Zindosteg.capacity(path)).to eq(file.capacity)
+          file.close
+        end
+      end
+    end
+  end
+
+  describe "PNG carriers" do
+    %w[default fast balanced smallest].product([false, true]).each do |profile, parallel|
+      it "decode with libpng after a #{profile}#{parallel ? ' parallel' : ''} commit" do
+        Dir.mktmpdir do |dir|
+          path = ::File.join(dir, "carrier.png")
+          original = Carriers.png(path, width: 512, height: 384)
+
+          embed(path, payload, compression: profile, parallel: parallel)
+
+          # Opening the carrier again decodes it with libpng.
+          expect(extract(path)).to eq(payload)
+          expect(Carriers.lsb_only?(Carriers.png_pixels(path), original)).to be true
+        end
+      end
+
+      it "decode with libpng after scattered writes and a second #{profile}#{parallel ? ' parallel' : ''} commit" do
+        Dir.mktmpdir do |dir|
+          path = ::File.join(dir, "carrier.png")
+          original = Carriers.png(path, width: 512, height: 384)
+          embed(path, payload, compression: profile, parallel: parallel)
+
+          expected = payload.dup
+          file = Zindosteg::File.open(path, "password", "r+")
+          file.compression = profile
+          file.parallel = parallel
+          { 5 => "first", 800 => "second", 1490 => "third" }.each do |pos, text|
+            file.seek(pos)
+            file.write(text)
+            expected[pos, text.bytesize] = text.b
+          end
+          file.flush
+          file.seek(300)
+          file.write("after the flush")
+          expected[300, 15] = "after the flush".b
+          file.close
+
+          expect(extract(path)).to eq(expected)
+          expect(Carriers.lsb_only?(Carriers.png_pixels(path), original)).to be true
+        end
+      end
+    end
+  end
+
+  describe "in-place carriers" do
+    {
+      "16-bit WAV" => ->(path) { Carriers.wav(path) },
+      "24-bit WAV" => ->(path) { Carriers.wav(path, channels: 1, bits: 24) },
+      "Y4M" => ->(path) { Carriers.y4m(path) },
+      "BMP" => ->(path) { Carriers.bmp(path) },
+    }.each do |kind, generate|
+      it "round trip a payload through a #{kind} changing only the lowest bits" do
+        Dir.mktmpdir do |dir|
+          path = ::File.join(dir, "carrier")
+          original = generate.call(path)
+
+          embed(path, payload)
+
+          expect(extract(path)).to eq(payload)
+          expect(Carriers.lsb_only?(::File.binread(path), original)).to be true
+        end
+      end
+    end
+
+    it "page a Y4M carrier through a budget smaller than the file" do
+      budget = Zindosteg.paged_memory_budget
+      Dir.mktmpdir do |dir|
+        path = ::File.join(dir, "carrier.y4m")
+        original = Carriers.y4m(path, frames: 8)
+        Zindosteg.paged_memory_budget = 64 * 1024
+
+        embed(path, payload)
+
+        expect(extract(path)).to eq(payload)
+        expect(Carriers.lsb_only?(::File.binread(path), original)).to be true
+      end
+    ensure
+      Zindosteg.paged_memory_budget = budget
+    end
+  end
+
+  describe "cache directory" do
+    after { Zindosteg.cache_directory = "" }
+
+    %w[jpg png].each do |format|
+      it "serves decoded #{format.upcase} carriers that round trip" do
+        Dir.mktmpdir do |dir|
+          Zindosteg.cache_directory = ::File.join(dir, "cache")
+          path = format == "jpg" ? Carriers.fixture("rst.jpg", dir) : ::File.join(dir, "carrier.png")
+          Carriers.png(path, width: 256, height: 256) if format == "png"
+
+          embed(path, payload)
+          expect(extract(path)).to eq(payload)
+          expect(Dir.children(Zindosteg.cache_directory)).not_to be_empty
+          # From the cache this time; then written through the cached carrier.
+          expect(extract(path)).to eq(payload)
+          file = Zindosteg::File.open(path, "password", "r+")
+          file.seek(100)
+          file.write("cached")
+          file.close
+
+          Zindosteg.cache_directory = ""
+          expected = payload.dup
+          expected[100, 6] = "cached".b
+          expect(extract(path)).to eq(expected)
+        end
+      end
+    end
+  end
+
+  describe "provider cache" do
+    before { Zindosteg.provider_cache_limit = 64 * 1024 * 1024 }
+    after { Zindosteg.provider_cache_limit = 0 }
+
+    it "serves carriers opened again until they change" do
+      Dir.mktmpdir do |dir|
+        path = Carriers.fixture("rst422.jpg", dir)
+        embed(path, payload)
+
+        hits = Zindosteg.provider_cache_stats[:hits]
+        expect(extract(path)).to eq(payload)
+        expect(extract(path)).to eq(payload)
+        expect(Zindosteg.provider_cache_stats[:hits]).to eq(hits + 1)
+
+        embed(path, payload.reverse)
+        expect(extract(path)).to eq(payload.reverse)
+      end
+    end
+
+    it "hands out snapshots that don't see each other's writes" do
+      Dir.mktmpdir do |dir|
+        path = ::File.join(dir, "carrier.png")
+        Carriers.png(path, width: 256, height: 256)
+        embed(path, "original", "first")
+        # The first open decodes the carrier into the cache, and both files get a snapshot of it.
+        hits = Zindosteg.provider_cache_stats[:hits]
+        first = Zindosteg::File.open(path, "first", "r+")
+        second = Zindosteg::File.open(path, "second", "w")
+        expect(Zindosteg.provider_cache_stats[:hits]).to eq(hits + 1)
+
+        first.write("one payload")
+        second.write("another payload")
+        copies = [first, second].each_with_index.map do |file, i|
+          copy = ::File.join(dir, "copy#{i}.png")
+          ::File.binwrite(copy, file.carrier_data)
+          copy
+        end
+        # Committing one snapshot leaves the other as it was.
+        first.close
+        expect(extract(path, "first")).to eq("one payload")
+        expect(::File.binread(copies[1])).to eq(second.carrier_data)
+        second.close
+
+        expect(extract(copies[0], "first")).to eq("one payload")
+        expect(extract(copies[1], "second")).to eq("another payload")
+        expect { extract(copies[1], "first") }.to raise_error(RuntimeError)
+      end
+    end
+  end
+
+  describe "line reading" do
+    let(:text) { (["short", "", "a somewhat longer line", "--", "x" * 9000, "end-- of --text"] * 2).join("\n") + "\n--tail" }
+
+    def open_with(text)
+      path = ::File.join(@dir, "carrier.png")
+      Carriers.png(path, width: 512, height: 512)
+      embed(path, text)
+      Zindosteg::File.open(path, "password")
+    end
+
+    around do |example|
+      Dir.mktmpdir do |dir|
+        @dir = dir
+        example.run
+      end
+    end
+
+    [[], ["\n"], ["--"], ["of --"], ["\n", 7], ["--", 4000], [100]].each do |args|
+      it "gets the lines File would with #{args.inspect}" do
+        file = open_with(text)
+        lines = []
+        while (line = file.gets(*args))
+          lines << line
+        end
+        file.close
+        expect(lines).to eq(StringIO.new(text).each_line(*args).to_a)
+      end
+
+      it "yields the lines File would from each with #{args.inspect}" do
+        file = open_with(text)
+        lines = []
+        file.each(*args) { |line| lines << line }
+        file.close
+        expect(lines).to eq(StringIO.new(text).each_line(*args).to_a)
+      end
+    end
   end
 end